@@ -5,8 +5,12 @@
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
@@ -32,8 +36,25 @@ typedef struct _formatdef {
     Py_ssize_t size;
     PyObject* (*get)(const void *, Py_ssize_t);
     int (*set)(void *, PyObject*, Py_ssize_t);
+    int bits;                   /* packed formats only, size is 0 */
 } formatdef;
 
+/* state of the background readahead worker, see mmap_prefetch_method */
+typedef struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             stop;
+
+    char *          data;           /* page aligned start of the mapping */
+    size_t          size;
+    size_t          skip;           /* bytes before the first element */
+    int             bits;           /* per element */
+    Py_ssize_t      last;           /* last accessed element, set by readers */
+    size_t          min_window;     /* readahead bounds in bytes */
+    size_t          max_window;
+} prefetch_state;
+
 typedef struct {
     PyObject_HEAD
     void *      data;
@@ -41,13 +62,31 @@ typedef struct {
     Py_ssize_t  elem;
     off_t       offset;
     char        type;
+    char        format[4];      /* for the buffer interface */
+    int         swapped;        /* elements are not in native byte order */
+    Py_ssize_t  itemsize;       /* 0 for packed formats */
+    int         bits;           /* per element */
+
+    /* Element i is stored at index start + i * step of data.  Views share
+       the mapping of their base, which keeps it in map until it is closed
+       and all views and buffers exported from it are gone. */
+    Py_ssize_t  start;
+    Py_ssize_t  step;
+    Py_ssize_t  stride;
+    PyObject *  base;
+    void *      map;            /* page aligned, data may start later */
+    size_t      map_size;
+    Py_ssize_t  exports;
 
     access_mode access;
+    prefetch_state *prefetch;
 
     PyObject* (*get)(const void *, Py_ssize_t);
     int (*set)(void *, PyObject*, Py_ssize_t);
 } mmap_object;
 
+static PyTypeObject mmap_object_type;
+
 static PyObject *
 get_pylong(PyObject *v)
 {
@@ -397,312 +436,3588 @@ static formatdef format_table[] = {
     {0}
 };
 
-static void
-mmap_object_dealloc(mmap_object *m_obj)
+static const formatdef *
+getentry(int c, const formatdef *f)
 {
-    if (m_obj->data!=NULL) {
-        munmap(m_obj->data, m_obj->size);
+    for (; f->format != '\0'; f++) {
+        if (f->format == c) {
+            return f;
+        }
     }
+    return NULL;
+}
 
-    Py_TYPE(m_obj)->tp_free((PyObject*)m_obj);
+/* Packed samples
+
+   The formats "10", "12" and "14" store every element in that many bits,
+   unsigned or, with an "s" prefix, signed ("u12" is the same as "12").
+   Element i occupies bits i * bits to (i + 1) * bits - 1 of the mapping,
+   counting from the least significant bit of the first byte, so two 12-bit
+   samples share three bytes. */
+
+static unsigned int
+packed_load(const unsigned char *p, Py_ssize_t i, int bits)
+{
+    size_t pos = (size_t)i * bits;
+    const unsigned char *q = p + (pos >> 3);
+    int sh = pos & 7;
+    unsigned int v = q[0] | q[1] << 8;
+
+    if (sh + bits > 16)
+        v |= (unsigned int)q[2] << 16;
+    return (v >> sh) & ((1U << bits) - 1);
 }
 
-static PyObject *
-mmap_close_method(mmap_object *self, PyObject *unused)
+static void
+packed_store(unsigned char *p, Py_ssize_t i, int bits, unsigned int x)
 {
-    if (self->data != NULL) {
-        munmap(self->data, self->size);
-        self->data = NULL;
-    }
+    size_t pos = (size_t)i * bits;
+    unsigned char *q = p + (pos >> 3);
+    int sh = pos & 7, three = sh + bits > 16;
+    unsigned int mask = ((1U << bits) - 1) << sh;
+    unsigned int v = q[0] | q[1] << 8;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if (three)
+        v |= (unsigned int)q[2] << 16;
+    v = (v & ~mask) | ((x << sh) & mask);
+    q[0] = (unsigned char)v;
+    q[1] = (unsigned char)(v >> 8);
+    if (three)
+        q[2] = (unsigned char)(v >> 16);
 }
 
-#define CHECK_VALID(err)                                                \
-do {                                                                    \
-    if (self->data == NULL) {                                           \
-    PyErr_SetString(PyExc_ValueError, "smmap closed or invalid");       \
-    return err;                                                         \
+#define PACKED_FORMAT(name, nbits, lo, hi)                              \
+static PyObject *                                                       \
+nu_##name(const void *p, Py_ssize_t i)                                  \
+{                                                                       \
+    long x = (long)packed_load(p, i, nbits);                            \
+    if ((lo) < 0)                                                       \
+        x = (x ^ (1L << (nbits - 1))) - (1L << (nbits - 1));            \
+    return PyInt_FromLong(x);                                           \
+}                                                                       \
+                                                                        \
+static int                                                              \
+np_##name(void *p, PyObject *v, Py_ssize_t i)                           \
+{                                                                       \
+    long x;                                                             \
+    if (get_long(v, &x) < 0)                                            \
+        return -1;                                                      \
+    if (x < (lo) || x > (hi)){                                          \
+        PyErr_SetString(PyExc_ValueError,                               \
+                        #name " format requires " #lo                   \
+                        " <= number <= " #hi);                          \
+        return -1;                                                      \
     }                                                                   \
-} while (0)
+    packed_store(p, i, nbits, (unsigned int)x);                         \
+    return 0;                                                           \
+}
 
-static int
-is_writeable(mmap_object *self)
+PACKED_FORMAT(u10, 10, 0, 1023)
+PACKED_FORMAT(s10, 10, -512, 511)
+PACKED_FORMAT(u12, 12, 0, 4095)
+PACKED_FORMAT(s12, 12, -2048, 2047)
+PACKED_FORMAT(u14, 14, 0, 16383)
+PACKED_FORMAT(s14, 14, -8192, 8191)
+
+static formatdef packed_table[] = {
+    {'u',       0,              nu_u10,         np_u10,         10},
+    {'s',       0,              nu_s10,         np_s10,         10},
+    {'u',       0,              nu_u12,         np_u12,         12},
+    {'s',       0,              nu_s12,         np_s12,         12},
+    {'u',       0,              nu_u14,         np_u14,         14},
+    {'s',       0,              nu_s14,         np_s14,         14},
+    {0}
+};
+
+/* Bulk conversion between packed samples and 16-bit integers.  Element i of
+   p is the first one converted; signed samples are sign extended. */
+
+static void
+unpack_scalar(const unsigned char *p, Py_ssize_t i, Py_ssize_t n, int bits,
+              int sign, unsigned short *out)
 {
-    if (self->access != ACCESS_READ)
-        return 1;
-    PyErr_Format(PyExc_TypeError, "smmap can't modify a readonly memory map.");
-    return 0;
+    int shift = 32 - bits;
+    Py_ssize_t k;
+
+    for (k = 0; k < n; k++) {
+        unsigned int v = packed_load(p, i + k, bits);
+        out[k] = sign ? (unsigned short)((int)(v << shift) >> shift)
+                      : (unsigned short)v;
+    }
 }
 
-static struct PyMethodDef mmap_object_methods[] = {
-    {"close",           (PyCFunction) mmap_close_method,        METH_NOARGS},
-    {NULL,         NULL}       /* sentinel */
-};
+static void
+pack_scalar(unsigned char *p, Py_ssize_t i, Py_ssize_t n, int bits,
+            const unsigned short *in)
+{
+    Py_ssize_t k;
 
-/* Functions for treating an mmap'ed file as a buffer */
+    for (k = 0; k < n; k++)
+        packed_store(p, i + k, bits, in[k]);
+}
 
-static Py_ssize_t
-mmap_buffer_getreadbuf(mmap_object *self, Py_ssize_t index, const void **ptr)
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <tmmintrin.h>
+
+/* 8 samples from 12 bytes: move the two bytes holding each sample into its
+   16-bit lane, then keep the low 12 bits of even and the high 12 bits of
+   odd lanes. */
+__attribute__((target("ssse3")))
+static void
+unpack12_ssse3(const unsigned char *p, Py_ssize_t i, Py_ssize_t n, int sign,
+               unsigned short *out)
 {
-    CHECK_VALID(-1);
-    if (index != 0) {
-        PyErr_SetString(PyExc_SystemError,
-                        "Accessing non-existent smmap segment");
-        return -1;
+    const __m128i shuf = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+                                       6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i even = _mm_set1_epi32(0x0000ffff);
+    const __m128i low12 = _mm_set1_epi16(0x0fff);
+    const unsigned char *q;
+    __m128i x, lo, hi;
+    Py_ssize_t k = 0;
+
+    if (n > 0 && (i & 1)) {
+        unpack_scalar(p, i, 1, 12, sign, out);
+        k = 1;
     }
-    *ptr = self->data;
-    return self->size;
+    q = p + (i + k) / 2 * 3;
+    /* 16 byte loads stay within the range while 11 samples are left */
+    for (; n - k >= 11; k += 8, q += 12) {
+        x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)q), shuf);
+        if (sign) {
+            lo = _mm_srai_epi16(_mm_slli_epi16(x, 4), 4);
+            hi = _mm_srai_epi16(x, 4);
+        }
+        else {
+            lo = _mm_and_si128(x, low12);
+            hi = _mm_srli_epi16(x, 4);
+        }
+        x = _mm_or_si128(_mm_and_si128(even, lo), _mm_andnot_si128(even, hi));
+        _mm_storeu_si128((__m128i *)(out + k), x);
+    }
+    unpack_scalar(p, i + k, n - k, 12, sign, out + k);
 }
 
-static Py_ssize_t
-mmap_buffer_getwritebuf(mmap_object *self, Py_ssize_t index, const void **ptr)
+/* 8 samples to 12 bytes: combine each pair into 24 bits of a 32-bit lane and
+   drop the top byte of every lane. */
+__attribute__((target("ssse3")))
+static void
+pack12_ssse3(unsigned char *p, Py_ssize_t i, Py_ssize_t n,
+             const unsigned short *in)
 {
-    CHECK_VALID(-1);
-    if (index != 0) {
-        PyErr_SetString(PyExc_SystemError,
-                        "Accessing non-existent smmap segment");
-        return -1;
+    const __m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+                                       10, 12, 13, 14, -1, -1, -1, -1);
+    const __m128i first = _mm_set1_epi32(0x00000fff);
+    const __m128i second = _mm_set1_epi32(0x00fff000);
+    unsigned char *q;
+    unsigned int tail;
+    __m128i x;
+    Py_ssize_t k = 0;
+
+    if (n > 0 && (i & 1)) {
+        pack_scalar(p, i, 1, 12, in);
+        k = 1;
     }
-    if (!is_writeable(self))
-        return -1;
-    *ptr = self->data;
-    return self->size;
+    q = p + (i + k) / 2 * 3;
+    for (; n - k >= 8; k += 8, q += 12) {
+        x = _mm_loadu_si128((const __m128i *)(in + k));
+        x = _mm_or_si128(_mm_and_si128(x, first),
+                         _mm_and_si128(_mm_srli_epi32(x, 4), second));
+        x = _mm_shuffle_epi8(x, shuf);
+        _mm_storel_epi64((__m128i *)q, x);
+        tail = (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+        memcpy(q + 8, &tail, 4);
+    }
+    pack_scalar(p, i + k, n - k, 12, in + k);
 }
 
-static Py_ssize_t
-mmap_buffer_getsegcount(mmap_object *self, Py_ssize_t *lenp)
+/* 10- and 14-bit samples come in groups of 8 in 10 or 14 bytes, starting at
+   a multiple of 4 samples.  Sample j of a group starts s = bits * j % 8 bits
+   into byte bits * j / 8; the shift pattern repeats every 4 samples.  The
+   variable shifts are multiplications by 2^s (mullo: left, mulhi: right). */
+
+typedef struct {
+    unsigned char w1[16];       /* bytes o, o + 1 of each sample */
+    unsigned char b2[16];       /* byte o + 2 of 14-bit samples with s > 2 */
+    short mh[8];                /* 2^(16 - s), 0 for s == 0 */
+    short ml[8];                /* 1 for s == 0 */
+    short ms[8];                /* 2^s */
+    unsigned char la[16];       /* output byte <- low byte of x << s */
+    unsigned char lb[16];       /* second sample in the same byte */
+    unsigned char h[16];        /* output byte <- x >> (16 - s) */
+} packed_group;
+
+#define X 0x80
+static const packed_group group10 = {
+    {0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 6, 7, 7, 8, 8, 9},
+    {X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X},
+    {0, 16384, 4096, 1024, 0, 16384, 4096, 1024},
+    {1, 0, 0, 0, 1, 0, 0, 0},
+    {1, 4, 16, 64, 1, 4, 16, 64},
+    {0, 1, 3, 5, 7, 8, 9, 11, 13, 15, X, X, X, X, X, X},
+    {X, 2, 4, 6, X, X, 10, 12, 14, X, X, X, X, X, X, X},
+    {X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X},
+};
+static const packed_group group14 = {
+    {0, 1, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 10, 11, 12, 13},
+    {X, X, 3, X, 5, X, X, X, X, X, 10, X, 12, X, X, X},
+    {0, 1024, 4096, 16384, 0, 1024, 4096, 16384},
+    {1, 0, 0, 0, 1, 0, 0, 0},
+    {1, 64, 16, 4, 1, 64, 16, 4},
+    {0, 1, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13, 14, 15, X, X},
+    {X, 2, X, X, X, X, X, X, 10, X, X, X, X, X, X, X},
+    {X, X, X, 2, X, 4, X, X, X, X, 10, X, 12, X, X, X},
+};
+#undef X
+
+#define LOAD_GROUP(field)   _mm_loadu_si128((const __m128i *)g->field)
+
+__attribute__((target("ssse3")))
+static void
+unpack_group_ssse3(const unsigned char *p, Py_ssize_t i, Py_ssize_t n,
+                   int bits, int sign, unsigned short *out)
 {
-    CHECK_VALID(-1);
-    if (lenp)
-        *lenp = self->size;
-    return 1;
+    const packed_group *g = bits == 10 ? &group10 : &group14;
+    const __m128i w1 = LOAD_GROUP(w1), b2 = LOAD_GROUP(b2);
+    const __m128i mh = LOAD_GROUP(mh), ml = LOAD_GROUP(ml);
+    const __m128i mask = _mm_set1_epi16((1 << bits) - 1);
+    const unsigned char *q;
+    __m128i x, v;
+    Py_ssize_t k = (4 - (i & 3)) & 3;
+
+    if (k > n)
+        k = n;
+    unpack_scalar(p, i, k, bits, sign, out);
+    q = p + (i + k) * bits / 8;
+    /* 16 byte loads stay within the range while 128 bits are left */
+    for (; (n - k) * bits >= 128; k += 8, q += bits) {
+        x = _mm_loadu_si128((const __m128i *)q);
+        v = _mm_shuffle_epi8(x, w1);
+        v = _mm_or_si128(_mm_or_si128(_mm_mulhi_epu16(v, mh),
+                                      _mm_mullo_epi16(v, ml)),
+                         _mm_mullo_epi16(_mm_shuffle_epi8(x, b2), mh));
+        if (sign)
+            v = _mm_srai_epi16(_mm_slli_epi16(v, 16 - bits), 16 - bits);
+        else
+            v = _mm_and_si128(v, mask);
+        _mm_storeu_si128((__m128i *)(out + k), v);
+    }
+    unpack_scalar(p, i + k, n - k, bits, sign, out + k);
 }
 
-static Py_ssize_t
-mmap_buffer_getcharbuffer(mmap_object *self, Py_ssize_t index, const void **ptr)
+__attribute__((target("ssse3")))
+static void
+pack_group_ssse3(unsigned char *p, Py_ssize_t i, Py_ssize_t n, int bits,
+                 const unsigned short *in)
 {
-    if (index != 0) {
-        PyErr_SetString(PyExc_SystemError,
-                        "accessing non-existent buffer segment");
-        return -1;
+    const packed_group *g = bits == 10 ? &group10 : &group14;
+    const __m128i ms = LOAD_GROUP(ms), la = LOAD_GROUP(la);
+    const __m128i lb = LOAD_GROUP(lb), h = LOAD_GROUP(h);
+    const __m128i mask = _mm_set1_epi16((1 << bits) - 1);
+    unsigned char *q, tmp[16];
+    __m128i x, lo, hi;
+    Py_ssize_t k = (4 - (i & 3)) & 3;
+
+    if (k > n)
+        k = n;
+    pack_scalar(p, i, k, bits, in);
+    q = p + (i + k) * bits / 8;
+    for (; n - k >= 8; k += 8, q += bits) {
+        x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + k)), mask);
+        lo = _mm_mullo_epi16(x, ms);
+        hi = _mm_mulhi_epu16(x, ms);
+        x = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(lo, la),
+                                      _mm_shuffle_epi8(lo, lb)),
+                         _mm_shuffle_epi8(hi, h));
+        _mm_storeu_si128((__m128i *)tmp, x);
+        memcpy(q, tmp, bits);
     }
-    *ptr = (const char *)self->data;
-    return self->size;
+    pack_scalar(p, i + k, n - k, bits, in + k);
 }
+#endif
 
-static Py_ssize_t
-mmap_length(mmap_object *self)
+static int have_ssse3;
+
+static void
+packed_unpack(const unsigned char *p, Py_ssize_t i, Py_ssize_t n, int bits,
+              int sign, unsigned short *out)
 {
-    CHECK_VALID(-1);
-    return self->elem;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (bits == 12 && have_ssse3) {
+        unpack12_ssse3(p, i, n, sign, out);
+        return;
+    }
+    if (have_ssse3) {
+        unpack_group_ssse3(p, i, n, bits, sign, out);
+        return;
+    }
+#endif
+    unpack_scalar(p, i, n, bits, sign, out);
 }
 
-static PyObject *
-mmap_item(mmap_object *self, Py_ssize_t i)
+static void
+packed_pack(unsigned char *p, Py_ssize_t i, Py_ssize_t n, int bits,
+            const unsigned short *in)
 {
-    CHECK_VALID(NULL);
-    if (i < 0 || i >= self->elem) {
-        PyErr_SetString(PyExc_IndexError, "smmap index out of range");
-        return NULL;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (bits == 12 && have_ssse3) {
+        pack12_ssse3(p, i, n, in);
+        return;
+    }
+    if (have_ssse3) {
+        pack_group_ssse3(p, i, n, bits, in);
+        return;
     }
-    return self->get(self->data, i);
+#endif
+    pack_scalar(p, i, n, bits, in);
 }
 
-static PyObject *
-mmap_slice(mmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh)
+/* Elements in non-native byte order go through a reversed, aligned copy */
+
+typedef union {
+    unsigned char b[8];
+    long l;
+    double d;
+} swapbuf;
+
+static void
+swap_copy(unsigned char *dst, const unsigned char *src, Py_ssize_t size)
 {
-    PyObject *ret;
-    PyObject *item;
-    Py_ssize_t len;
-    Py_ssize_t i;
+    Py_ssize_t k;
 
-    CHECK_VALID(NULL);
-    if (ilow < 0)
-        ilow = 0;
-    else if (ilow > self->elem)
-        ilow = self->elem;
-    if (ihigh < 0)
-        ihigh = 0;
-    if (ihigh < ilow)
-        ihigh = ilow;
-    else if (ihigh > self->elem)
-        ihigh = self->elem;
+    for (k = 0; k < size; k++)
+        dst[k] = src[size - 1 - k];
+}
 
-    len = ihigh - ilow;
+#define SWAPPED_FORMAT(name, type)                                      \
+static PyObject *                                                       \
+su_##name(const void *p, Py_ssize_t i)                                  \
+{                                                                       \
+    swapbuf x;                                                          \
+    swap_copy(x.b, (const unsigned char *)p + i * sizeof(type),         \
+              sizeof(type));                                            \
+    return nu_##name(x.b, 0);                                           \
+}                                                                       \
+                                                                        \
+static int                                                              \
+sp_##name(void *p, PyObject *v, Py_ssize_t i)                           \
+{                                                                       \
+    swapbuf x;                                                          \
+    if (np_##name(x.b, v, 0) < 0)                                       \
+        return -1;                                                      \
+    swap_copy((unsigned char *)p + i * sizeof(type), x.b, sizeof(type)); \
+    return 0;                                                           \
+}
 
-    if ((ret = PyTuple_New(len)) == NULL) {
-        return NULL;
-    }
+SWAPPED_FORMAT(short, short)
+SWAPPED_FORMAT(ushort, unsigned short)
+SWAPPED_FORMAT(int, int)
+SWAPPED_FORMAT(uint, unsigned int)
+SWAPPED_FORMAT(long, long)
+SWAPPED_FORMAT(ulong, unsigned long)
+SWAPPED_FORMAT(float, float)
+SWAPPED_FORMAT(double, double)
 
-    for (i = 0; i < len; i++) {
-        item = self->get(self->data, i + ilow);
-        if (!item) {
-            Py_DECREF(ret);
+static formatdef swapped_table[] = {
+    {'b',       sizeof(char),   nu_byte,        np_byte},
+    {'B',       sizeof(char),   nu_ubyte,       np_ubyte},
+    {'h',       sizeof(short),  su_short,       sp_short},
+    {'H',       sizeof(short),  su_ushort,      sp_ushort},
+    {'i',       sizeof(int),    su_int,         sp_int},
+    {'I',       sizeof(int),    su_uint,        sp_uint},
+    {'l',       sizeof(long),   su_long,        sp_long},
+    {'L',       sizeof(long),   su_ulong,       sp_ulong},
+    {'f',       sizeof(float),  su_float,       sp_float},
+    {'d',       sizeof(double), su_double,      sp_double},
+    {0}
+};
+
+#ifdef WORDS_BIGENDIAN
+#define NATIVE_ORDER    '>'
+#define SWAPPED_ORDER   '<'
+#else
+#define NATIVE_ORDER    '<'
+#define SWAPPED_ORDER   '>'
+#endif
+
+/* Look up a format string: a struct format character, optionally preceded
+   by a byte order character as in the struct module, or a packed format.
+   Sizes stay native whatever the byte order. */
+static const formatdef *
+parse_format(const char *fmt, int *swapped)
+{
+    const formatdef *f;
+    char sign = 'u';
+    char *end;
+    long bits;
+
+    *swapped = 0;
+    if (fmt == NULL || *fmt == 0)
+        return NULL;
+    switch (*fmt) {
+    case '>':
+    case '!':
+    case '<':
+        *swapped = (*fmt == '<') != (NATIVE_ORDER == '<');
+        /* fall through */
+    case '=':
+    case '@':
+        fmt++;
+        if (*fmt == 0 || fmt[1] != 0)
             return NULL;
-        }
-        PyTuple_SET_ITEM(ret, i, item);
+        f = getentry(*fmt, *swapped ? swapped_table : format_table);
+        if (f != NULL && f->size == 1)
+            *swapped = 0;
+        return f;
     }
+    if ((*fmt == 'u' || *fmt == 's') && fmt[1] >= '0' && fmt[1] <= '9')
+        sign = *fmt++;
+    else if (*fmt < '0' || *fmt > '9')
+        return getentry(*fmt, format_table);
 
-    return ret;
+    bits = strtol(fmt, &end, 10);
+    if (*end != 0)
+        return NULL;
+    for (f = packed_table; f->format != '\0'; f++)
+        if (f->format == sign && f->bits == bits)
+            return f;
+    return NULL;
 }
 
-static PyObject *
-mmap_concat(mmap_object *self, PyObject *bb)
+/* Background readahead
+
+   The worker wakes up every PREFETCH_TICK_MS, looks at the last element a
+   reader touched and issues MADV_WILLNEED for the bytes ahead of it.  The
+   window follows the consumption rate: it covers PREFETCH_LOOKAHEAD_MS worth
+   of reading, clamped to [min_window, max_window].  Seeking backwards restarts
+   the readahead from the new position. */
+
+#define PREFETCH_TICK_MS        10
+#define PREFETCH_LOOKAHEAD_MS   250
+
+static double
+prefetch_now(void)
 {
-    CHECK_VALID(NULL);
-    PyErr_SetString(PyExc_SystemError,
-                    "smmaps don't support concatenation");
-    return NULL;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static PyObject *
-mmap_repeat(mmap_object *self, Py_ssize_t n)
+static void *
+prefetch_worker(void *arg)
 {
-    CHECK_VALID(NULL);
-    PyErr_SetString(PyExc_SystemError,
-                    "smmaps don't support repeat operation");
+    prefetch_state *p = (prefetch_state *)arg;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pos, prev = p->skip, ahead = p->skip, window = p->min_window;
+    double rate = 0, t, prev_t = prefetch_now();
+    struct timespec deadline;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PREFETCH_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&p->cond, &p->lock, &deadline);
+        if (p->stop)
+            break;
+        pthread_mutex_unlock(&p->lock);
+
+        pos = p->skip +
+              (size_t)__atomic_load_n(&p->last, __ATOMIC_RELAXED) * p->bits / 8;
+        t = prefetch_now();
+        if (pos > prev) {
+            /* exponentially weighted bytes per second */
+            rate = 0.5 * rate + 0.5 * (pos - prev) / (t - prev_t);
+            window = (size_t)(rate * (PREFETCH_LOOKAHEAD_MS / 1000.0));
+            if (window < p->min_window)
+                window = p->min_window;
+            else if (window > p->max_window)
+                window = p->max_window;
+        }
+        else if (pos < prev) {
+            ahead = pos;
+            rate = 0;
+            window = p->min_window;
+        }
+        prev = pos;
+        prev_t = t;
+
+        if (ahead < pos)
+            ahead = pos;
+        if (pos + window > ahead && ahead < p->size) {
+            size_t start = ahead & ~(page - 1);
+            size_t end = pos + window;
+            if (end > p->size)
+                end = p->size;
+            madvise(p->data + start, end - start, MADV_WILLNEED);
+            ahead = end;
+        }
+
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
     return NULL;
 }
 
-static int
-mmap_ass_slice(mmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *v)
+static void
+prefetch_stop(mmap_object *self)
 {
-    PyObject *seq;
-    PyObject **items;
-    Py_ssize_t i;
-    Py_ssize_t len;
+    prefetch_state *p = self->prefetch;
 
-    CHECK_VALID(-1);
-    if (ilow < 0)
-        ilow = 0;
-    else if (ilow > self->elem)
-        ilow = self->elem;
-    if (ihigh < 0)
-        ihigh = 0;
-    if (ihigh < ilow)
-        ihigh = ilow;
-    else if (ihigh > self->elem)
-        ihigh = self->elem;
+    if (p == NULL)
+        return;
+    self->prefetch = NULL;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    PyMem_Free(p);
+}
 
-    len = ihigh - ilow;
+static int
+prefetch_start(mmap_object *self, size_t min_window, size_t max_window)
+{
+    prefetch_state *p;
+    int err;
 
-    if (v == NULL) {
-        PyErr_SetString(PyExc_TypeError,
-                        "smmap object doesn't support slice deletion");
-        return -1;
-    }
-    if ((seq = PySequence_Fast(v, "smmap slice assignment must be a sequence")) == NULL ) {
-        return -1;
-    }
-    if (PySequence_Fast_GET_SIZE(seq) != len) {
-        PyErr_SetString(PyExc_IndexError,
-                        "smmap slice assignment is wrong size");
-        Py_DECREF(seq);
+    p = PyMem_Malloc(sizeof(prefetch_state));
+    if (p == NULL) {
+        PyErr_NoMemory();
         return -1;
     }
-    if (!is_writeable(self)) {
-        Py_DECREF(seq);
+    p->stop = 0;
+    p->data = self->map;
+    p->size = self->map_size;
+    p->skip = (char *)self->data - (char *)self->map;
+    p->bits = self->bits;
+    p->last = 0;
+    p->min_window = min_window;
+    p->max_window = max_window;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if ((err = pthread_create(&p->thread, NULL, prefetch_worker, p)) != 0) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        PyMem_Free(p);
+        errno = err;
+        PyErr_SetFromErrno(mmap_module_error);
         return -1;
     }
-    items = PySequence_Fast_ITEMS(seq);
-    for(i = 0; i < len; i++) {
-        if (self->set(self->data, items[i], i + ilow) == -1) {
-            Py_DECREF(seq);
-            return -1;
-        }
-    }
-    Py_DECREF(seq);
+    self->prefetch = p;
     return 0;
 }
 
-static int
-mmap_ass_item(mmap_object *self, Py_ssize_t i, PyObject *v)
+#define MMAP_INDEX(self, i)     ((self)->start + (i) * (self)->step)
+#define MMAP_ROOT(self)                                                 \
+    ((self)->base != NULL ? (mmap_object *)(self)->base : (self))
+
+/* remember the position of the reader for the readahead worker */
+#define PREFETCH_RECORD(self, i)                                        \
+do {                                                                    \
+    prefetch_state *p_ = MMAP_ROOT(self)->prefetch;                     \
+    if (p_ != NULL)                                                     \
+        __atomic_store_n(&p_->last, MMAP_INDEX(self, i), __ATOMIC_RELAXED); \
+} while (0)
+
+/* Views, exported buffers and operations running without the GIL keep the
+   mapping alive: close only unmaps it once the last of them is released. */
+static void
+mmap_export(mmap_object *self)
 {
-    CHECK_VALID(-1);
-    if (i < 0 || i >= self->elem) {
-        PyErr_SetString(PyExc_IndexError, "smmap index out of range");
-        return -1;
-    }
+    MMAP_ROOT(self)->exports++;
+}
+
+static void
+mmap_unexport(mmap_object *self)
+{
+    mmap_object *root = MMAP_ROOT(self);
+
+    if (--root->exports == 0 && root->data == NULL && root->map != NULL) {
+        munmap(root->map, root->map_size);
+        root->map = NULL;
+    }
+}
+
+/* unaligned little-endian access */
+
+static unsigned long long
+load_le64(const unsigned char *p)
+{
+    unsigned long long x;
+    memcpy(&x, p, sizeof(x));
+#ifdef WORDS_BIGENDIAN
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static void
+store_le64(unsigned char *p, unsigned long long x)
+{
+#ifdef WORDS_BIGENDIAN
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(p, &x, sizeof(x));
+}
+
+static void
+mmap_object_dealloc(mmap_object *m_obj)
+{
+    prefetch_stop(m_obj);
+    if (m_obj->map!=NULL) {
+        munmap(m_obj->map, m_obj->map_size);
+    }
+
+    Py_TYPE(m_obj)->tp_free((PyObject*)m_obj);
+}
+
+static PyObject *
+mmap_close_method(mmap_object *self, PyObject *unused)
+{
+    prefetch_stop(self);
+    if (self->data != NULL) {
+        self->data = NULL;
+        if (self->exports == 0) {
+            munmap(self->map, self->map_size);
+            self->map = NULL;
+        }
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+#define CHECK_VALID(err)                                                \
+do {                                                                    \
+    if (self->data == NULL) {                                           \
+    PyErr_SetString(PyExc_ValueError, "smmap closed or invalid");       \
+    return err;                                                         \
+    }                                                                   \
+} while (0)
+
+static int
+is_writeable(mmap_object *self)
+{
+    if (self->access != ACCESS_READ)
+        return 1;
+    PyErr_Format(PyExc_TypeError, "smmap can't modify a readonly memory map.");
+    return 0;
+}
+
+/* Bytes spanned by the elements ilow:ihigh of self */
+static void
+mmap_extent(mmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh,
+            char **begin, char **end)
+{
+    Py_ssize_t a = MMAP_INDEX(self, ilow), b = MMAP_INDEX(self, ihigh - 1), t;
+
+    if (a > b) {
+        t = a;
+        a = b;
+        b = t;
+    }
+    if (self->itemsize) {
+        *begin = (char *)self->data + a * self->itemsize;
+        *end = (char *)self->data + (b + 1) * self->itemsize;
+    }
+    else {
+        *begin = (char *)self->data + a * self->bits / 8;
+        *end = (char *)self->data + ((b + 1) * self->bits + 7) / 8;
+    }
+}
+
+/* Pointer to element ilow and the number of bytes up to element ihigh, if
+   the elements are stored back to back.  Packed ranges must start on a byte
+   boundary and end on one or at the end of the mapping. */
+static char *
+mmap_bytes(mmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh, size_t *len)
+{
+    Py_ssize_t first = MMAP_INDEX(self, ilow), end = MMAP_INDEX(self, ihigh);
+
+    if (self->step != 1) {
+        PyErr_SetString(PyExc_ValueError, "smmap view is not contiguous");
+        return NULL;
+    }
+    if ((first * self->bits) % 8 != 0 ||
+        ((end * self->bits) % 8 != 0 && end != MMAP_ROOT(self)->elem)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "smmap range does not start and end on a byte boundary");
+        return NULL;
+    }
+    *len = (end * self->bits + 7) / 8 - first * self->bits / 8;
+    return (char *)self->data + first * self->bits / 8;
+}
+
+static PyObject *
+mmap_prefetch_method(mmap_object *self, PyObject *args)
+{
+    Py_ssize_t window, max_window = -1;
+
+    /* the readahead belongs to the mapping, which may be closed while a
+       view of it is still open */
+    self = MMAP_ROOT(self);
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTuple(args, "n|n:prefetch", &window, &max_window))
+        return NULL;
+    if (max_window < 0)
+        max_window = 64 * window;
+    if (window < 0 || max_window < window) {
+        PyErr_SetString(PyExc_ValueError,
+                        "prefetch requires 0 <= window <= max_window");
+        return NULL;
+    }
+
+    prefetch_stop(self);
+    if (window > 0 && self->size > 0) {
+        if (prefetch_start(self, window * self->bits / 8,
+                           max_window * self->bits / 8) < 0)
+            return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Worker threads
+
+   Bulk operations split their range into one argument block per thread and
+   run without the GIL.  run_threads runs fn on the first block in the calling
+   thread and on the others in new threads, or inline if one can't be
+   started. */
+
+#define MAX_THREADS     64
+
+static void
+run_threads(void *(*fn)(void *), void *args, size_t size, int n)
+{
+    pthread_t thread[MAX_THREADS];
+    int started[MAX_THREADS];
+    int k;
+
+    for (k = 1; k < n; k++)
+        started[k] = pthread_create(&thread[k], NULL, fn,
+                                    (char *)args + k * size) == 0;
+    fn(args);
+    for (k = 1; k < n; k++) {
+        if (started[k])
+            pthread_join(thread[k], NULL);
+        else
+            fn((char *)args + k * size);
+    }
+}
+
+/* clamp ilow/ihigh like slicing does */
+static void
+mmap_clamp(mmap_object *self, Py_ssize_t *ilow, Py_ssize_t *ihigh)
+{
+    if (*ilow < 0)
+        *ilow = 0;
+    else if (*ilow > self->elem)
+        *ilow = self->elem;
+    if (*ihigh < 0)
+        *ihigh = 0;
+    if (*ihigh < *ilow)
+        *ihigh = *ilow;
+    else if (*ihigh > self->elem)
+        *ihigh = self->elem;
+}
+
+/* CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when available */
+
+#define CRC32C_POLY     0x82f63b78U
+
+static unsigned int crc32c_table[8][256];
+
+static void
+crc32c_init(void)
+{
+    unsigned int n, k, crc;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = crc32c_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+}
+
+/* slicing-by-8 */
+static unsigned int
+crc32c_sw(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long long w;
+
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        w = load_le64(p) ^ crc;
+        crc = crc32c_table[7][w & 0xff] ^
+              crc32c_table[6][(w >> 8) & 0xff] ^
+              crc32c_table[5][(w >> 16) & 0xff] ^
+              crc32c_table[4][(w >> 24) & 0xff] ^
+              crc32c_table[3][(w >> 32) & 0xff] ^
+              crc32c_table[2][(w >> 40) & 0xff] ^
+              crc32c_table[1][(w >> 48) & 0xff] ^
+              crc32c_table[0][w >> 56];
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static unsigned int
+crc32c_hw(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long long c = ~crc, w;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = (unsigned int)c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+#endif
+
+static unsigned int (*crc32c)(unsigned int, const unsigned char *, size_t) = crc32c_sw;
+
+/* GF(2) matrix helpers for crc32c_combine, after zlib's crc32_combine */
+static unsigned int
+gf2_times(const unsigned int *mat, unsigned int vec)
+{
+    unsigned int sum = 0;
+
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void
+gf2_square(unsigned int *square, const unsigned int *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; n++)
+        square[n] = gf2_times(mat, mat[n]);
+}
+
+/* CRC of the concatenation of two blocks from their CRCs */
+static unsigned int
+crc32c_combine(unsigned int crc1, unsigned int crc2, size_t len2)
+{
+    unsigned int even[32], odd[32], row = 1;
+    int n;
+
+    if (len2 == 0)
+        return crc1;
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+    gf2_square(even, odd);          /* two zero bits */
+    gf2_square(odd, even);          /* four zero bits */
+    do {
+        gf2_square(even, odd);
+        if (len2 & 1)
+            crc1 = gf2_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0)
+            break;
+        gf2_square(odd, even);
+        if (len2 & 1)
+            crc1 = gf2_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+    return crc1 ^ crc2;
+}
+
+/* xxHash64 */
+
+#define XXH_PRIME1      0x9e3779b185ebca87ULL
+#define XXH_PRIME2      0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME3      0x165667b19e3779f9ULL
+#define XXH_PRIME4      0x85ebca77c2b2ae63ULL
+#define XXH_PRIME5      0x27d4eb2f165667c5ULL
+#define XXH_ROTL(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsigned long long
+xxh64_round(unsigned long long acc, unsigned long long input)
+{
+    acc += input * XXH_PRIME2;
+    acc = XXH_ROTL(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static unsigned long long
+xxh64_merge(unsigned long long acc, unsigned long long val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static unsigned long long
+xxh64(const unsigned char *p, size_t len, unsigned long long seed)
+{
+    const unsigned char *end = p + len;
+    unsigned long long h, v1, v2, v3, v4;
+    unsigned int w;
+
+    if (len >= 32) {
+        v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        v2 = seed + XXH_PRIME2;
+        v3 = seed;
+        v4 = seed - XXH_PRIME1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh64_round(v1, load_le64(p));
+            v2 = xxh64_round(v2, load_le64(p + 8));
+            v3 = xxh64_round(v3, load_le64(p + 16));
+            v4 = xxh64_round(v4, load_le64(p + 24));
+        }
+        h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) + XXH_ROTL(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    }
+    else
+        h = seed + XXH_PRIME5;
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, load_le64(p));
+        h = XXH_ROTL(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        w = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+        h ^= w * XXH_PRIME1;
+        h = XXH_ROTL(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME5;
+        h = XXH_ROTL(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t      len;
+    size_t      chunk;          /* tree hash leaf size */
+    unsigned char *digests;     /* tree hash leaf digests */
+    unsigned long long result;
+} checksum_part;
+
+static void *
+checksum_crc32c_worker(void *arg)
+{
+    checksum_part *part = (checksum_part *)arg;
+
+    part->result = crc32c(0, part->data, part->len);
+    return NULL;
+}
+
+static void *
+checksum_tree_worker(void *arg)
+{
+    checksum_part *part = (checksum_part *)arg;
+    size_t off;
+
+    for (off = 0; off < part->len; off += part->chunk) {
+        size_t n = part->len - off < part->chunk ? part->len - off : part->chunk;
+        store_le64(part->digests + 8 * (off / part->chunk),
+                   xxh64(part->data + off, n, 0));
+    }
+    return NULL;
+}
+
+static PyObject *
+mmap_checksum_method(mmap_object *self, PyObject *args, PyObject *kwdict)
+{
+    checksum_part part[MAX_THREADS];
+    const char *algo;
+    const unsigned char *data;
+    Py_ssize_t ilow = 0, ihigh = PY_SSIZE_T_MAX;
+    size_t len, per, off, chunk = 1 << 20, leaves = 0;
+    int threads = 1, tree = 0, k;
+    unsigned long long result;
+    unsigned char *digests = NULL;
+    static char *keywords[] = {"algo", "start", "stop", "threads",
+                               "tree", "chunk", NULL};
+
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "s|nniin:checksum", keywords,
+                                     &algo, &ilow, &ihigh, &threads,
+                                     &tree, &chunk))
+        return NULL;
+    if (strcmp(algo, "crc32c") != 0 && strcmp(algo, "xxh64") != 0) {
+        PyErr_Format(PyExc_ValueError, "unknown checksum algorithm '%s'", algo);
+        return NULL;
+    }
+    if (tree && ((Py_ssize_t)chunk <= 0 || strcmp(algo, "xxh64") != 0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "tree hash requires xxh64 and a positive chunk size");
+        return NULL;
+    }
+    if (threads < 1)
+        threads = 1;
+    else if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    mmap_clamp(self, &ilow, &ihigh);
+    if ((data = (unsigned char *)mmap_bytes(self, ilow, ihigh, &len)) == NULL)
+        return NULL;
+
+    if (tree) {
+        leaves = (len + chunk - 1) / chunk;
+        if ((digests = PyMem_Malloc(8 * leaves + 1)) == NULL)
+            return PyErr_NoMemory();
+        /* whole leaves per thread */
+        per = (leaves + threads - 1) / threads * chunk;
+    }
+    else
+        per = (len + threads - 1) / threads;
+
+    mmap_export(self);
+    Py_BEGIN_ALLOW_THREADS
+    if (strcmp(algo, "xxh64") == 0 && !tree) {
+        result = xxh64(data, len, 0);
+    }
+    else {
+        for (k = 0; k < threads; k++) {
+            off = per * k < len ? per * k : len;
+            part[k].data = data + off;
+            part[k].len = len - off < per ? len - off : per;
+            part[k].chunk = chunk;
+            part[k].digests = digests + (tree ? 8 * (off / chunk) : 0);
+        }
+        if (tree) {
+            run_threads(checksum_tree_worker, part, sizeof(checksum_part), threads);
+            result = xxh64(digests, 8 * leaves, 0);
+        }
+        else {
+            run_threads(checksum_crc32c_worker, part, sizeof(checksum_part), threads);
+            result = part[0].result;
+            for (k = 1; k < threads; k++)
+                result = crc32c_combine((unsigned int)result,
+                                        (unsigned int)part[k].result,
+                                        part[k].len);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    mmap_unexport(self);
+
+    PyMem_Free(digests);
+    return PyLong_FromUnsignedLongLong(result);
+}
+
+static PyObject *
+mmap_unpack_method(mmap_object *self, PyObject *args)
+{
+    Py_ssize_t ilow = 0, ihigh = PY_SSIZE_T_MAX, len;
+    PyObject *out = Py_None, *ret;
+    void *buf;
+
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTuple(args, "|nnO:unpack", &ilow, &ihigh, &out))
+        return NULL;
+    if (self->itemsize != 0) {
+        PyErr_SetString(PyExc_TypeError, "unpack requires a packed format");
+        return NULL;
+    }
+    if (self->step != 1) {
+        PyErr_SetString(PyExc_ValueError, "smmap view is not contiguous");
+        return NULL;
+    }
+    mmap_clamp(self, &ilow, &ihigh);
+
+    if (out == Py_None) {
+        ret = PyByteArray_FromStringAndSize(NULL, 2 * (ihigh - ilow));
+        if (ret == NULL)
+            return NULL;
+        buf = PyByteArray_AS_STRING(ret);
+    }
+    else {
+        if (PyObject_AsWriteBuffer(out, &buf, &len) < 0)
+            return NULL;
+        if (len < 2 * (ihigh - ilow)) {
+            PyErr_SetString(PyExc_ValueError, "unpack output buffer too small");
+            return NULL;
+        }
+        ret = out;
+        Py_INCREF(ret);
+    }
+
+    PREFETCH_RECORD(self, ihigh);
+    packed_unpack(self->data, MMAP_INDEX(self, ilow), ihigh - ilow,
+                  self->bits, self->type == 's', buf);
+    return ret;
+}
+
+static PyObject *
+mmap_pack_method(mmap_object *self, PyObject *args)
+{
+    Py_ssize_t start = 0, len, n, k;
+    PyObject *src, *item;
+    const unsigned short *in;
+    const void *buf;
+    int lo, hi, sign;
+
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTuple(args, "O|n:pack", &src, &start))
+        return NULL;
+    if (self->itemsize != 0) {
+        PyErr_SetString(PyExc_TypeError, "pack requires a packed format");
+        return NULL;
+    }
+    if (self->step != 1) {
+        PyErr_SetString(PyExc_ValueError, "smmap view is not contiguous");
+        return NULL;
+    }
+    if (!is_writeable(self))
+        return NULL;
+    if (PyObject_AsReadBuffer(src, &buf, &len) < 0)
+        return NULL;
+    if (len % 2 != 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "pack data must be a whole number of 16-bit samples");
+        return NULL;
+    }
+    in = buf;
+    n = len / 2;
+    if (start < 0 || start > self->elem || n > self->elem - start) {
+        PyErr_SetString(PyExc_IndexError, "pack data exceeds the smmap");
+        return NULL;
+    }
+
+    /* check everything first, the setter reports the first bad sample */
+    sign = self->type == 's';
+    hi = (1 << (self->bits - sign)) - 1;
+    lo = sign ? -hi - 1 : 0;
+    for (k = 0; k < n; k++) {
+        int v = sign ? (short)in[k] : in[k];
+        if (v < lo || v > hi) {
+            if ((item = PyInt_FromLong(v)) != NULL) {
+                self->set(self->data, item, MMAP_INDEX(self, start + k));
+                Py_DECREF(item);
+            }
+            return NULL;
+        }
+    }
+
+    PREFETCH_RECORD(self, start + n);
+    packed_pack(self->data, MMAP_INDEX(self, start), n, self->bits, in);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Scratch memory for bulk operations: from the heap up to limit bytes,
+   beyond that a mapping of an unlinked temporary file in dir (or the
+   default temporary directory), so that large scratch areas live in the
+   page cache of a disk instead of in anonymous memory.  Sets a Python
+   exception on failure. */
+static void *
+scratch_alloc(size_t size, size_t limit, const char *dir, int *mapped)
+{
+    FILE *tmp = NULL;
+    char *path;
+    void *p = NULL;
+    int fd;
+
+    *mapped = size > limit;
+    if (!*mapped) {
+        if ((p = malloc(size ? size : 1)) == NULL)
+            PyErr_NoMemory();
+        return p;
+    }
+    if (dir != NULL) {
+        if ((path = PyMem_Malloc(strlen(dir) + 16)) == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        sprintf(path, "%s/smmap-XXXXXX", dir);
+        if ((fd = mkstemp(path)) >= 0)
+            unlink(path);
+        PyMem_Free(path);
+    }
+    else {
+        tmp = tmpfile();
+        fd = tmp != NULL ? fileno(tmp) : -1;
+    }
+    if (fd >= 0 && ftruncate(fd, size) == 0) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            p = NULL;
+    }
+    if (p == NULL)
+        PyErr_SetFromErrno(mmap_module_error);
+    if (tmp != NULL)
+        fclose(tmp);
+    else if (fd >= 0)
+        close(fd);
+    return p;
+}
+
+static void
+scratch_free(void *p, size_t size, int mapped)
+{
+    if (mapped)
+        munmap(p, size);
+    else
+        free(p);
+}
+
+/* Sorting
+
+   argsort is a stable parallel LSD radix sort on 8-bit digits, done on a
+   copy of the keys and the indices.  Every pass counts the digits
+   of each thread's part, turns the counts into stable output positions and
+   scatters the keys (and for argsort their indices) into the other buffer.
+   Passes where all keys share the digit are skipped.  Signed and float keys
+   are mapped to unsigned ones with the same order first and back after. */
+
+enum {
+    KEY_UNSIGNED,
+    KEY_SIGNED,
+    KEY_FLOAT,
+};
+
+typedef struct {
+    void *      src;
+    void *      dst;
+    void *      isrc;               /* indices for argsort or NULL */
+    void *      idst;
+    int         iwide;              /* 64 instead of 32-bit indices */
+    Py_ssize_t  lo;
+    Py_ssize_t  hi;
+    int         shift;
+    int         kind;
+    int         inverse;
+    Py_ssize_t  count[256];
+} radix_part;
+
+#define RADIX_FUNCS(name, type)                                         \
+static void *                                                           \
+radix_key_##name(void *arg)                                             \
+{                                                                       \
+    radix_part *part = (radix_part *)arg;                               \
+    const type *src = part->src;                                        \
+    type *dst = part->dst, top = (type)1 << (8 * sizeof(type) - 1), x;  \
+    Py_ssize_t k;                                                       \
+    for (k = part->lo; k < part->hi; k++) {                             \
+        x = src[k];                                                     \
+        if (part->kind == KEY_SIGNED)                                   \
+            x ^= top;                                                   \
+        else if (part->kind == KEY_FLOAT)                               \
+            x ^= ((x & top) != 0) != part->inverse ? (type)~(type)0 : top; \
+        dst[k] = x;                                                     \
+        if (part->idst == NULL)                                         \
+            continue;                                                   \
+        if (part->iwide)                                                \
+            ((unsigned long long *)part->idst)[k] = k;                  \
+        else                                                            \
+            ((unsigned int *)part->idst)[k] = (unsigned int)k;          \
+    }                                                                   \
+    return NULL;                                                        \
+}                                                                       \
+                                                                        \
+static void *                                                           \
+radix_count_##name(void *arg)                                           \
+{                                                                       \
+    radix_part *part = (radix_part *)arg;                               \
+    const type *src = part->src;                                        \
+    Py_ssize_t k;                                                       \
+    memset(part->count, 0, sizeof(part->count));                        \
+    for (k = part->lo; k < part->hi; k++)                               \
+        part->count[(src[k] >> part->shift) & 0xff]++;                  \
+    return NULL;                                                        \
+}                                                                       \
+                                                                        \
+static void *                                                           \
+radix_scatter_##name(void *arg)                                         \
+{                                                                       \
+    radix_part *part = (radix_part *)arg;                               \
+    const type *src = part->src;                                        \
+    type *dst = part->dst;                                              \
+    Py_ssize_t k, pos;                                                  \
+    for (k = part->lo; k < part->hi; k++) {                             \
+        pos = part->count[(src[k] >> part->shift) & 0xff]++;            \
+        dst[pos] = src[k];                                              \
+        if (part->isrc == NULL)                                         \
+            continue;                                                   \
+        if (part->iwide)                                                \
+            ((unsigned long long *)part->idst)[pos] =                   \
+                ((const unsigned long long *)part->isrc)[k];            \
+        else                                                            \
+            ((unsigned int *)part->idst)[pos] =                         \
+                ((const unsigned int *)part->isrc)[k];                  \
+    }                                                                   \
+    return NULL;                                                        \
+}
+
+/* sort, which needs no stability, permutes the keys in place instead: an
+   MSD radix sort moving every key along the cycle of bucket heads it belongs
+   to (American flag sort), with insertion sort for small buckets.  Below the
+   first digit that splits the keys, the buckets are sorted in parallel. */
+
+#define AFS_SMALL       32
+
+#define AFS_FUNCS(name, type)                                           \
+static void                                                             \
+afs_partition_##name(void *keys, Py_ssize_t n, int shift, Py_ssize_t *count) \
+{                                                                       \
+    type *a = keys, x, y;                                               \
+    Py_ssize_t head[256], tail[256], k, pos = 0;                        \
+    int b, d;                                                           \
+    memset(count, 0, 256 * sizeof(*count));                             \
+    for (k = 0; k < n; k++)                                             \
+        count[(a[k] >> shift) & 0xff]++;                                \
+    for (b = 0; b < 256; b++) {                                         \
+        if (count[b] == n)                                              \
+            return;                                                     \
+        head[b] = pos;                                                  \
+        pos += count[b];                                                \
+        tail[b] = pos;                                                  \
+    }                                                                   \
+    for (b = 0; b < 256; b++)                                           \
+        while (head[b] < tail[b]) {                                     \
+            x = a[head[b]];                                             \
+            while ((d = (x >> shift) & 0xff) != b) {                    \
+                y = a[head[d]];                                         \
+                a[head[d]++] = x;                                       \
+                x = y;                                                  \
+            }                                                           \
+            a[head[b]++] = x;                                           \
+        }                                                               \
+}                                                                       \
+                                                                        \
+static void                                                             \
+afs_sort_##name(void *keys, Py_ssize_t n, int shift)                    \
+{                                                                       \
+    type *a = keys, x;                                                  \
+    Py_ssize_t count[256], k, j, pos;                                   \
+    int b;                                                              \
+    if (n < AFS_SMALL) {                                                \
+        for (k = 1; k < n; k++) {                                       \
+            x = a[k];                                                   \
+            for (j = k; j > 0 && a[j - 1] > x; j--)                     \
+                a[j] = a[j - 1];                                        \
+            a[j] = x;                                                   \
+        }                                                               \
+        return;                                                         \
+    }                                                                   \
+    afs_partition_##name(a, n, shift, count);                           \
+    if (shift == 0)                                                     \
+        return;                                                         \
+    for (b = 0, pos = 0; b < 256; pos += count[b], b++)                 \
+        if (count[b] > 1)                                               \
+            afs_sort_##name(a + pos, count[b], shift - 8);              \
+}
+
+RADIX_FUNCS(u8, unsigned char)
+RADIX_FUNCS(u16, unsigned short)
+RADIX_FUNCS(u32, unsigned int)
+RADIX_FUNCS(u64, unsigned long long)
+AFS_FUNCS(u8, unsigned char)
+AFS_FUNCS(u16, unsigned short)
+AFS_FUNCS(u32, unsigned int)
+AFS_FUNCS(u64, unsigned long long)
+
+typedef struct {
+    void *(*key)(void *);
+    void *(*count)(void *);
+    void *(*scatter)(void *);
+    void (*partition)(void *, Py_ssize_t, int, Py_ssize_t *);
+    void (*sort)(void *, Py_ssize_t, int);
+} radix_funcs;
+
+static const radix_funcs *
+radix_lookup(Py_ssize_t size)
+{
+    static const radix_funcs funcs[] = {
+        {radix_key_u8, radix_count_u8, radix_scatter_u8,
+         afs_partition_u8, afs_sort_u8},
+        {radix_key_u16, radix_count_u16, radix_scatter_u16,
+         afs_partition_u16, afs_sort_u16},
+        {radix_key_u32, radix_count_u32, radix_scatter_u32,
+         afs_partition_u32, afs_sort_u32},
+        {radix_key_u64, radix_count_u64, radix_scatter_u64,
+         afs_partition_u64, afs_sort_u64},
+    };
+
+    switch (size) {
+    case 1: return &funcs[0];
+    case 2: return &funcs[1];
+    case 4: return &funcs[2];
+    case 8: return &funcs[3];
+    }
+    return NULL;
+}
+
+static void
+radix_split(radix_part *part, Py_ssize_t n, int threads)
+{
+    int t;
+
+    for (t = 0; t < threads; t++) {
+        part[t].lo = n * t / threads;
+        part[t].hi = n * (t + 1) / threads;
+    }
+}
+
+/* map keys from src to dst (or back with inverse), starting indices if idx */
+static void
+radix_keys(const radix_funcs *f, void *src, void *dst, void *idx, int iwide,
+           Py_ssize_t n, int kind, int inverse, int threads)
+{
+    radix_part part[MAX_THREADS];
+    int t;
+
+    if (kind == KEY_UNSIGNED && src == dst && idx == NULL)
+        return;
+    radix_split(part, n, threads);
+    for (t = 0; t < threads; t++) {
+        part[t].src = src;
+        part[t].dst = dst;
+        part[t].idst = idx;
+        part[t].iwide = iwide;
+        part[t].kind = kind;
+        part[t].inverse = inverse;
+    }
+    run_threads(f->key, part, sizeof(radix_part), threads);
+}
+
+/* sort the indices idx by n keys of size bytes; scratch and iscratch are
+   buffers of the same sizes as keys and idx.  Only idx holds the result,
+   the sorted keys are left in either keys or scratch. */
+static void
+radix_sort(const radix_funcs *f, void *keys, void *scratch,
+           void *idx, void *iscratch, int iwide,
+           Py_ssize_t n, Py_ssize_t size, int threads)
+{
+    radix_part part[MAX_THREADS];
+    void *src = keys, *dst = scratch, *tmp;
+    void *isrc = idx, *idst = iscratch, *itmp;
+    Py_ssize_t total, off, c;
+    int shift, t, b, skip;
+
+    radix_split(part, n, threads);
+    for (shift = 0; shift < 8 * size; shift += 8) {
+        for (t = 0; t < threads; t++) {
+            part[t].src = src;
+            part[t].dst = dst;
+            part[t].isrc = isrc;
+            part[t].idst = idst;
+            part[t].iwide = iwide;
+            part[t].shift = shift;
+        }
+        run_threads(f->count, part, sizeof(radix_part), threads);
+
+        skip = 0;
+        off = 0;
+        for (b = 0; b < 256; b++) {
+            total = 0;
+            for (t = 0; t < threads; t++) {
+                c = part[t].count[b];
+                part[t].count[b] = off;
+                off += c;
+                total += c;
+            }
+            if (total == n)
+                skip = 1;
+        }
+        if (skip)
+            continue;
+
+        run_threads(f->scatter, part, sizeof(radix_part), threads);
+        tmp = src; src = dst; dst = tmp;
+        itmp = isrc; isrc = idst; idst = itmp;
+    }
+    if (isrc != idx)
+        memcpy(idx, isrc, n * (iwide ? 8 : 4));
+}
+
+typedef struct {
+    const radix_funcs *f;
+    char *      keys;
+    Py_ssize_t  size;
+    Py_ssize_t  start[256];
+    Py_ssize_t  count[256];
+    int         shift;
+    int         next;           /* next bucket to sort, taken atomically */
+} afs_job;
+
+static void *
+afs_worker(void *arg)
+{
+    afs_job *job = *(afs_job **)arg;
+    int b;
+
+    while ((b = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < 256)
+        if (job->count[b] > 1)
+            job->f->sort(job->keys + job->start[b] * job->size,
+                         job->count[b], job->shift);
+    return NULL;
+}
+
+/* sort n keys of size bytes in place */
+static void
+radix_sort_inplace(const radix_funcs *f, void *keys, Py_ssize_t n,
+                   Py_ssize_t size, int threads)
+{
+    afs_job job, *jobs[MAX_THREADS];
+    Py_ssize_t pos = 0;
+    int shift = 8 * (int)size - 8, b, t;
+
+    if (threads == 1 || n < AFS_SMALL) {
+        f->sort(keys, n, shift);
+        return;
+    }
+    /* leading digits shared by all keys leave the counts at a single bucket */
+    for (;; shift -= 8) {
+        f->partition(keys, n, shift, job.count);
+        for (b = 0; b < 256 && job.count[b] != n; b++)
+            ;
+        if (b == 256 || shift == 0)
+            break;
+    }
+    if (shift == 0)
+        return;
+    for (b = 0; b < 256; b++) {
+        job.start[b] = pos;
+        pos += job.count[b];
+    }
+    job.f = f;
+    job.keys = keys;
+    job.size = size;
+    job.shift = shift - 8;
+    job.next = 0;
+    for (t = 0; t < threads; t++)
+        jobs[t] = &job;
+    run_threads(afs_worker, jobs, sizeof(afs_job *), threads);
+}
+
+static int
+sort_key_kind(mmap_object *self, const radix_funcs **f, int *kind)
+{
+    if (self->itemsize == 0 || self->swapped ||
+        (*f = radix_lookup(self->itemsize)) == NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "sorting requires a whole byte format in native byte order");
+        return -1;
+    }
+    if (self->step != 1) {
+        PyErr_SetString(PyExc_ValueError, "smmap view is not contiguous");
+        return -1;
+    }
+    if (strchr("bhil", self->type))
+        *kind = KEY_SIGNED;
+    else if (strchr("fd", self->type))
+        *kind = KEY_FLOAT;
+    else
+        *kind = KEY_UNSIGNED;
+    return 0;
+}
+
+#define SORT_MEMORY     (256 << 20)
+
+static PyObject *
+mmap_sort_method(mmap_object *self, PyObject *args, PyObject *kwdict)
+{
+    Py_ssize_t ilow = 0, ihigh = PY_SSIZE_T_MAX, n;
+    int threads = 1, kind;
+    const radix_funcs *f;
+    void *keys;
+    static char *keywords[] = {"start", "stop", "threads", NULL};
+
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "|nni:sort", keywords,
+                                     &ilow, &ihigh, &threads))
+        return NULL;
+    if (sort_key_kind(self, &f, &kind) < 0 || !is_writeable(self))
+        return NULL;
+    if (threads < 1)
+        threads = 1;
+    else if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    mmap_clamp(self, &ilow, &ihigh);
+    n = ihigh - ilow;
+    keys = (char *)self->data + MMAP_INDEX(self, ilow) * self->itemsize;
+
+    if (n > 1) {
+        mmap_export(self);
+        Py_BEGIN_ALLOW_THREADS
+        radix_keys(f, keys, keys, NULL, 0, n, kind, 0, threads);
+        radix_sort_inplace(f, keys, n, self->itemsize, threads);
+        radix_keys(f, keys, keys, NULL, 0, n, kind, 1, threads);
+        Py_END_ALLOW_THREADS
+        mmap_unexport(self);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* The sorted indices end up in out.  32-bit indices share the memory of an
+   l or L output and are widened at the end, so only the keys need scratch
+   space. */
+static PyObject *
+mmap_argsort_method(mmap_object *self, PyObject *args, PyObject *kwdict)
+{
+    mmap_object *out;
+    Py_ssize_t ilow = 0, ihigh = PY_SSIZE_T_MAX, n, k, size, isize, extra;
+    Py_ssize_t memory = SORT_MEMORY, total;
+    int threads = 1, kind, mapped, iwide;
+    const radix_funcs *f;
+    const char *tmpdir = NULL;
+    char *src, *dst, *scratch, *keys, *iscratch, *sb, *se, *db, *de;
+    unsigned long long max;
+    static char *keywords[] = {"out", "start", "stop", "threads", "memory",
+                               "tmpdir", NULL};
+
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "O!|nninz:argsort", keywords,
+                                     &mmap_object_type, &out, &ilow, &ihigh,
+                                     &threads, &memory, &tmpdir))
+        return NULL;
+    if (sort_key_kind(self, &f, &kind) < 0)
+        return NULL;
+    if (out->data == NULL) {
+        PyErr_SetString(PyExc_ValueError, "smmap closed or invalid");
+        return NULL;
+    }
+    if (!is_writeable(out))
+        return NULL;
+    if (memory < 0) {
+        PyErr_SetString(PyExc_ValueError, "sort memory must not be negative");
+        return NULL;
+    }
+    if (threads < 1)
+        threads = 1;
+    else if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    mmap_clamp(self, &ilow, &ihigh);
+    n = ihigh - ilow;
+
+    switch (out->swapped || out->step != 1 ? 0 : out->type) {
+    case 'i': max = INT_MAX; break;
+    case 'I': max = UINT_MAX; break;
+    case 'l': max = LONG_MAX; break;
+    case 'L': max = ULONG_MAX; break;
+    default:
+        PyErr_SetString(PyExc_TypeError,
+                        "argsort output must be a contiguous native i, I, l or L smmap");
+        return NULL;
+    }
+    if (out->elem < n || (n > 0 && (unsigned long long)(n - 1) > max)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "argsort output is too short or can't hold the indices");
+        return NULL;
+    }
+    if (n == 0) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    /* out is written while the keys are still read */
+    mmap_extent(self, ilow, ihigh, &sb, &se);
+    mmap_extent(out, 0, n, &db, &de);
+    if (sb < de && db < se) {
+        PyErr_SetString(PyExc_ValueError,
+                        "argsort output overlaps the elements to sort");
+        return NULL;
+    }
+
+    size = self->itemsize;
+    src = (char *)self->data + MMAP_INDEX(self, ilow) * size;
+    dst = (char *)out->data + out->start * out->itemsize;
+    iwide = n > 0 && (unsigned long long)(n - 1) > UINT_MAX;
+    isize = iwide ? 8 : 4;
+    /* the second index buffer fits into out next to the first one, or is
+       placed in front of the keys */
+    extra = 2 * isize <= out->itemsize ? 0 : (n * isize + 7) & ~(Py_ssize_t)7;
+    total = extra + 2 * n * size;
+    if ((scratch = scratch_alloc(total, memory, tmpdir, &mapped)) == NULL)
+        return NULL;
+    iscratch = extra ? scratch : dst + n * isize;
+    keys = scratch + extra;
+
+    mmap_export(self);
+    mmap_export(out);
+    Py_BEGIN_ALLOW_THREADS
+    radix_keys(f, src, keys, dst, iwide, n, kind, 0, threads);
+    radix_sort(f, keys, keys + n * size, dst, iscratch, iwide, n, size, threads);
+    if (isize < out->itemsize)
+        for (k = n - 1; k >= 0; k--)
+            ((unsigned long *)dst)[k] = ((unsigned int *)dst)[k];
+    Py_END_ALLOW_THREADS
+    mmap_unexport(out);
+    mmap_unexport(self);
+    scratch_free(scratch, total, mapped);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Conversion of elements to doubles for the numeric kernels */
+
+static double
+item_to_double(char type, const void *p)
+{
+    switch (type) {
+    case 'b': return *(const signed char *)p;
+    case 'B': return *(const unsigned char *)p;
+    case 'h': return *(const short *)p;
+    case 'H': return *(const unsigned short *)p;
+    case 'i': return *(const int *)p;
+    case 'I': return *(const unsigned int *)p;
+    case 'l': return *(const long *)p;
+    case 'L': return *(const unsigned long *)p;
+    case 'f': return *(const float *)p;
+    default:  return *(const double *)p;
+    }
+}
+
+#define TO_DOUBLE(type)                                                 \
+    for (k = 0; k < n; k++)                                             \
+        out[k] = ((const type *)p)[idx + k * step];                     \
+    break;
+
+/* convert the n elements from element i of self on to doubles */
+static void
+mmap_to_double(mmap_object *self, Py_ssize_t i, Py_ssize_t n, double *out)
+{
+    const char *p = self->data;
+    Py_ssize_t idx = MMAP_INDEX(self, i), step = self->step, k;
+    int shift = 32 - self->bits;
+    swapbuf x;
+
+    if (self->itemsize == 0) {
+        for (k = 0; k < n; k++) {
+            unsigned int v = packed_load(self->data, idx + k * step, self->bits);
+            out[k] = self->type == 's' ? (int)(v << shift) >> shift : (double)v;
+        }
+        return;
+    }
+    if (self->swapped) {
+        for (k = 0; k < n; k++) {
+            swap_copy(x.b, (const unsigned char *)p + (idx + k * step) * self->itemsize,
+                      self->itemsize);
+            out[k] = item_to_double(self->type, x.b);
+        }
+        return;
+    }
+    switch (self->type) {
+    case 'b': TO_DOUBLE(signed char)
+    case 'B': TO_DOUBLE(unsigned char)
+    case 'h': TO_DOUBLE(short)
+    case 'H': TO_DOUBLE(unsigned short)
+    case 'i': TO_DOUBLE(int)
+    case 'I': TO_DOUBLE(unsigned int)
+    case 'l': TO_DOUBLE(long)
+    case 'L': TO_DOUBLE(unsigned long)
+    case 'f': TO_DOUBLE(float)
+    case 'd': TO_DOUBLE(double)
+    }
+}
+
+/* Windowed kernels
+
+   rolling and fir produce one output for every complete window in the range
+   ("valid" mode), output k covering the elements start + k to
+   start + k + window - 1.  Every thread streams its share of the outputs
+   through blocks of WINDOW_BLOCK elements, reading window - 1 elements in
+   front of its first output. */
+
+#define WINDOW_BLOCK    4096
+
+enum {
+    ROLL_SUM,
+    ROLL_MEAN,
+    ROLL_MIN,
+    ROLL_MAX,
+    ROLL_FIR,
+};
+
+typedef struct {
+    mmap_object *src;
+    Py_ssize_t  start;          /* element of output 0 */
+    Py_ssize_t  lo;             /* outputs of this part */
+    Py_ssize_t  hi;
+    Py_ssize_t  window;
+    int         kind;
+    const double *taps;         /* reversed */
+    char *      out;
+    char        out_type;
+    int         nomem;
+} window_part;
+
+static void
+store_doubles(window_part *part, Py_ssize_t k, const double *v, Py_ssize_t n)
+{
+    Py_ssize_t j;
+
+    if (part->out_type == 'f')
+        for (j = 0; j < n; j++)
+            ((float *)part->out)[k + j] = (float)v[j];
+    else
+        memcpy((double *)part->out + k, v, n * sizeof(double));
+}
+
+static void *
+rolling_worker(void *arg)
+{
+    window_part *part = (window_part *)arg;
+    Py_ssize_t w = part->window, first = part->start + part->lo;
+    Py_ssize_t end = part->start + part->hi + w - 1;
+    Py_ssize_t s, n, j, k, r = 0, head = 0, tail = 0, o, since = 0;
+    double *buf, *ring, *res, *dval, sum = 0, x;
+    Py_ssize_t *didx;
+    int is_max = part->kind == ROLL_MAX;
+
+    if (part->lo >= part->hi)
+        return NULL;
+    buf = malloc(2 * WINDOW_BLOCK * sizeof(double));
+    ring = malloc((w + 1) * sizeof(double));
+    didx = malloc((w + 1) * sizeof(Py_ssize_t));
+    if (buf == NULL || ring == NULL || didx == NULL) {
+        part->nomem = 1;
+        goto done;
+    }
+    res = buf + WINDOW_BLOCK;
+    dval = ring;
+
+    for (s = first; s < end; s += n) {
+        n = end - s < WINDOW_BLOCK ? end - s : WINDOW_BLOCK;
+        mmap_to_double(part->src, s, n, buf);
+        o = 0;
+        for (j = 0; j < n; j++) {
+            k = s + j;
+            x = buf[j];
+            if (part->kind == ROLL_SUM || part->kind == ROLL_MEAN) {
+                /* ring holds the last w elements, the sum is recomputed
+                   from it every w steps to bound the rounding drift */
+                if (k - first >= w)
+                    sum -= ring[r];
+                ring[r] = x;
+                if (++r == w)
+                    r = 0;
+                sum += x;
+                if (k - first + 1 >= w && ++since == w) {
+                    Py_ssize_t q;
+                    since = 0;
+                    sum = 0;
+                    for (q = 0; q < w; q++)
+                        sum += ring[q];
+                }
+                if (k - first + 1 >= w)
+                    res[o++] = part->kind == ROLL_MEAN ? sum / w : sum;
+            }
+            else {
+                /* monotonic deque in a ring of w + 1 slots from head to
+                   tail, holding at most w elements */
+                if (tail != head && didx[head] <= k - w)
+                    if (++head > w)
+                        head = 0;
+                while (tail != head) {
+                    Py_ssize_t back = (tail == 0 ? w + 1 : tail) - 1;
+                    if (is_max ? dval[back] > x : dval[back] < x)
+                        break;
+                    tail = back;
+                }
+                dval[tail] = x;
+                didx[tail] = k;
+                if (++tail > w)
+                    tail = 0;
+                if (k - first + 1 >= w)
+                    res[o++] = dval[head];
+            }
+        }
+        store_doubles(part, part->lo, res, o);
+        part->lo += o;
+    }
+
+  done:
+    free(buf);
+    free(ring);
+    free(didx);
+    return NULL;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* y[k] = sum r[j] * x[k + j]; four outputs at a time in two SSE2 registers,
+   which keeps the summation order, and so the result, of the scalar loop */
+static void
+fir_block(const double *x, const double *r, Py_ssize_t ntaps,
+          Py_ssize_t nout, double *y)
+{
+    Py_ssize_t k = 0, j;
+    double acc;
+
+#if defined(__SSE2__)
+    for (; k + 4 <= nout; k += 4) {
+        __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd(), t;
+        for (j = 0; j < ntaps; j++) {
+            t = _mm_set1_pd(r[j]);
+            a0 = _mm_add_pd(a0, _mm_mul_pd(t, _mm_loadu_pd(x + k + j)));
+            a1 = _mm_add_pd(a1, _mm_mul_pd(t, _mm_loadu_pd(x + k + j + 2)));
+        }
+        _mm_storeu_pd(y + k, a0);
+        _mm_storeu_pd(y + k + 2, a1);
+    }
+#endif
+    for (; k < nout; k++) {
+        acc = 0;
+        for (j = 0; j < ntaps; j++)
+            acc += r[j] * x[k + j];
+        y[k] = acc;
+    }
+}
+
+static void *
+fir_worker(void *arg)
+{
+    window_part *part = (window_part *)arg;
+    Py_ssize_t w = part->window, n;
+    double *buf, *res;
+
+    if (part->lo >= part->hi)
+        return NULL;
+    if ((buf = malloc((2 * WINDOW_BLOCK + w) * sizeof(double))) == NULL) {
+        part->nomem = 1;
+        return NULL;
+    }
+    res = buf + WINDOW_BLOCK + w;
+    for (; part->lo < part->hi; part->lo += n) {
+        n = part->hi - part->lo < WINDOW_BLOCK ? part->hi - part->lo : WINDOW_BLOCK;
+        mmap_to_double(part->src, part->start + part->lo, n + w - 1, buf);
+        fir_block(buf, part->taps, w, n, res);
+        store_doubles(part, part->lo, res, n);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Runs a windowed kernel over the elements ilow:ihigh of self.  out may be
+   NULL for a tuple of floats, a native 'd' or 'f' smmap or a writable buffer
+   of doubles. */
+static PyObject *
+window_run(mmap_object *self, int kind, Py_ssize_t window, const double *taps,
+           Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *out, int threads)
+{
+    window_part part[MAX_THREADS];
+    mmap_object *pin = NULL;
+    Py_ssize_t nout, len, k;
+    char *dst, *sb, *se, out_type = 'd';
+    double *tmp = NULL;
+    PyObject *ret;
+    int t, nomem = 0;
+
+    if (threads < 1)
+        threads = 1;
+    else if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    mmap_clamp(self, &ilow, &ihigh);
+    nout = ihigh - ilow >= window ? ihigh - ilow - window + 1 : 0;
+
+    if (out == NULL || out == Py_None) {
+        if ((tmp = PyMem_Malloc(nout * sizeof(double) + 1)) == NULL)
+            return PyErr_NoMemory();
+        dst = (char *)tmp;
+    }
+    else if (PyObject_TypeCheck(out, &mmap_object_type)) {
+        pin = (mmap_object *)out;
+        if (pin->data == NULL) {
+            PyErr_SetString(PyExc_ValueError, "smmap closed or invalid");
+            return NULL;
+        }
+        if (!is_writeable(pin))
+            return NULL;
+        if ((pin->type != 'd' && pin->type != 'f') || pin->swapped ||
+            pin->step != 1) {
+            PyErr_SetString(PyExc_TypeError,
+                            "output must be a contiguous native d or f smmap");
+            return NULL;
+        }
+        if (pin->elem < nout) {
+            PyErr_SetString(PyExc_ValueError, "output smmap is too short");
+            return NULL;
+        }
+        dst = (char *)pin->data + pin->start * pin->itemsize;
+        out_type = pin->type;
+    }
+    else {
+        void *buf;
+        if (PyObject_AsWriteBuffer(out, &buf, &len) < 0)
+            return NULL;
+        if (len < nout * (Py_ssize_t)sizeof(double)) {
+            PyErr_SetString(PyExc_ValueError, "output buffer is too short");
+            return NULL;
+        }
+        dst = buf;
+    }
+    /* the threads read window - 1 elements ahead of what they write */
+    if (tmp == NULL && nout > 0) {
+        mmap_extent(self, ilow, ihigh, &sb, &se);
+        if (sb < dst + nout * (out_type == 'f' ? 4 : 8) && dst < se) {
+            PyErr_SetString(PyExc_ValueError,
+                            "output overlaps the elements it is computed from");
+            return NULL;
+        }
+    }
+
+    for (t = 0; t < threads; t++) {
+        part[t].src = self;
+        part[t].start = ilow;
+        part[t].lo = nout * t / threads;
+        part[t].hi = nout * (t + 1) / threads;
+        part[t].window = window;
+        part[t].kind = kind;
+        part[t].taps = taps;
+        part[t].out = dst;
+        part[t].out_type = out_type;
+        part[t].nomem = 0;
+    }
+
+    /* a foreign buffer could be resized by another thread without the GIL */
+    mmap_export(self);
+    if (out == NULL || out == Py_None || pin != NULL) {
+        if (pin != NULL)
+            mmap_export(pin);
+        Py_BEGIN_ALLOW_THREADS
+        run_threads(kind == ROLL_FIR ? fir_worker : rolling_worker,
+                    part, sizeof(window_part), threads);
+        Py_END_ALLOW_THREADS
+        if (pin != NULL)
+            mmap_unexport(pin);
+    }
+    else
+        run_threads(kind == ROLL_FIR ? fir_worker : rolling_worker,
+                    part, sizeof(window_part), threads);
+    mmap_unexport(self);
+
+    for (t = 0; t < threads; t++)
+        nomem |= part[t].nomem;
+    if (nomem) {
+        PyMem_Free(tmp);
+        return PyErr_NoMemory();
+    }
+    if (tmp == NULL) {
+        Py_INCREF(out);
+        return out;
+    }
+    if ((ret = PyTuple_New(nout)) != NULL) {
+        for (k = 0; k < nout; k++) {
+            PyObject *item = PyFloat_FromDouble(tmp[k]);
+            if (item == NULL) {
+                Py_CLEAR(ret);
+                break;
+            }
+            PyTuple_SET_ITEM(ret, k, item);
+        }
+    }
+    PyMem_Free(tmp);
+    return ret;
+}
+
+static PyObject *
+mmap_rolling_method(mmap_object *self, PyObject *args, PyObject *kwdict)
+{
+    static const char *kinds[] = {"sum", "mean", "min", "max", NULL};
+    const char *kind;
+    Py_ssize_t window, ilow = 0, ihigh = PY_SSIZE_T_MAX;
+    PyObject *out = NULL;
+    int threads = 1, k;
+    static char *keywords[] = {"kind", "window", "start", "stop", "out",
+                               "threads", NULL};
+
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "sn|nnOi:rolling", keywords,
+                                     &kind, &window, &ilow, &ihigh, &out,
+                                     &threads))
+        return NULL;
+    for (k = 0; kinds[k] != NULL; k++)
+        if (strcmp(kind, kinds[k]) == 0)
+            break;
+    if (kinds[k] == NULL) {
+        PyErr_Format(PyExc_ValueError, "unknown rolling kind '%s'", kind);
+        return NULL;
+    }
+    if (window < 1) {
+        PyErr_SetString(PyExc_ValueError, "rolling window must be positive");
+        return NULL;
+    }
+    return window_run(self, ROLL_SUM + k, window, NULL, ilow, ihigh, out,
+                      threads);
+}
+
+static PyObject *
+mmap_fir_method(mmap_object *self, PyObject *args, PyObject *kwdict)
+{
+    PyObject *taps_obj, *seq, *out = NULL, *ret;
+    Py_ssize_t ilow = 0, ihigh = PY_SSIZE_T_MAX, ntaps, j;
+    double *taps;
+    int threads = 1;
+    static char *keywords[] = {"taps", "start", "stop", "out", "threads", NULL};
+
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "O|nnOi:fir", keywords,
+                                     &taps_obj, &ilow, &ihigh, &out, &threads))
+        return NULL;
+    if ((seq = PySequence_Fast(taps_obj, "fir taps must be a sequence")) == NULL)
+        return NULL;
+    if ((ntaps = PySequence_Fast_GET_SIZE(seq)) == 0) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "fir requires at least one tap");
+        return NULL;
+    }
+    if ((taps = PyMem_Malloc(ntaps * sizeof(double))) == NULL) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    /* reversed, so that every output is a dot product with its window */
+    for (j = 0; j < ntaps; j++) {
+        taps[ntaps - 1 - j] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, j));
+        if (taps[ntaps - 1 - j] == -1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            PyMem_Free(taps);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+
+    ret = window_run(self, ROLL_FIR, ntaps, taps, ilow, ihigh, out, threads);
+    PyMem_Free(taps);
+    return ret;
+}
+
+static PyObject *
+mmap_view_method(mmap_object *self, PyObject *args);
+
+static struct PyMethodDef mmap_object_methods[] = {
+    {"close",           (PyCFunction) mmap_close_method,        METH_NOARGS},
+    {"prefetch",        (PyCFunction) mmap_prefetch_method,     METH_VARARGS},
+    {"view",            (PyCFunction) mmap_view_method,         METH_VARARGS},
+    {"unpack",          (PyCFunction) mmap_unpack_method,       METH_VARARGS},
+    {"pack",            (PyCFunction) mmap_pack_method,         METH_VARARGS},
+    {"sort",            (PyCFunction) mmap_sort_method,         METH_VARARGS | METH_KEYWORDS},
+    {"argsort",         (PyCFunction) mmap_argsort_method,      METH_VARARGS | METH_KEYWORDS},
+    {"rolling",         (PyCFunction) mmap_rolling_method,      METH_VARARGS | METH_KEYWORDS},
+    {"fir",             (PyCFunction) mmap_fir_method,          METH_VARARGS | METH_KEYWORDS},
+    {"checksum",        (PyCFunction) mmap_checksum_method,     METH_VARARGS | METH_KEYWORDS},
+    {NULL,         NULL}       /* sentinel */
+};
+
+/* Functions for treating an mmap'ed file as a buffer */
+
+static Py_ssize_t
+mmap_buffer_getreadbuf(mmap_object *self, Py_ssize_t index, const void **ptr)
+{
+    size_t len;
+
+    CHECK_VALID(-1);
+    if (index != 0) {
+        PyErr_SetString(PyExc_SystemError,
+                        "Accessing non-existent smmap segment");
+        return -1;
+    }
+    if ((*ptr = mmap_bytes(self, 0, self->elem, &len)) == NULL)
+        return -1;
+    return len;
+}
+
+static Py_ssize_t
+mmap_buffer_getwritebuf(mmap_object *self, Py_ssize_t index, const void **ptr)
+{
+    size_t len;
+
+    CHECK_VALID(-1);
+    if (index != 0) {
+        PyErr_SetString(PyExc_SystemError,
+                        "Accessing non-existent smmap segment");
+        return -1;
+    }
+    if (!is_writeable(self))
+        return -1;
+    if ((*ptr = mmap_bytes(self, 0, self->elem, &len)) == NULL)
+        return -1;
+    return len;
+}
+
+static Py_ssize_t
+mmap_buffer_getsegcount(mmap_object *self, Py_ssize_t *lenp)
+{
+    CHECK_VALID(-1);
+    if (lenp)
+        *lenp = (self->elem * self->bits + 7) / 8;
+    return 1;
+}
+
+static Py_ssize_t
+mmap_buffer_getcharbuffer(mmap_object *self, Py_ssize_t index, const void **ptr)
+{
+    size_t len;
+
+    if (index != 0) {
+        PyErr_SetString(PyExc_SystemError,
+                        "accessing non-existent buffer segment");
+        return -1;
+    }
+    CHECK_VALID(-1);
+    if ((*ptr = mmap_bytes(self, 0, self->elem, &len)) == NULL)
+        return -1;
+    return len;
+}
+
+static int
+mmap_buffer_getbuf(mmap_object *self, Py_buffer *view, int flags)
+{
+    CHECK_VALID(-1);
+    if ((flags & PyBUF_WRITABLE) && !is_writeable(self))
+        return -1;
+    if (self->step != 1 && (flags & PyBUF_STRIDES) != PyBUF_STRIDES) {
+        PyErr_SetString(PyExc_BufferError, "smmap view is not contiguous");
+        return -1;
+    }
+    if (self->itemsize == 0) {
+        /* packed samples are exported as their bytes */
+        size_t len;
+        if ((view->buf = mmap_bytes(self, 0, self->elem, &len)) == NULL)
+            return -1;
+        view->len = len;
+        view->itemsize = 1;
+    }
+    else {
+        view->buf = (char *)self->data + self->start * self->itemsize;
+        view->len = self->elem * self->itemsize;
+        view->itemsize = self->itemsize;
+    }
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->readonly = self->access == ACCESS_READ;
+    view->format = NULL;
+    if (flags & PyBUF_FORMAT)
+        view->format = self->format;
+    view->ndim = 1;
+    view->shape = NULL;
+    if ((flags & PyBUF_ND) == PyBUF_ND)
+        view->shape = self->itemsize == 0 ? &view->len : &self->elem;
+    view->strides = NULL;
+    if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+        view->strides = self->itemsize == 0 ? &view->itemsize : &self->stride;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    mmap_export(self);
+    return 0;
+}
+
+static void
+mmap_buffer_releasebuf(mmap_object *self, Py_buffer *view)
+{
+    mmap_unexport(self);
+}
+
+static Py_ssize_t
+mmap_length(mmap_object *self)
+{
+    CHECK_VALID(-1);
+    return self->elem;
+}
+
+static PyObject *
+mmap_item(mmap_object *self, Py_ssize_t i)
+{
+    CHECK_VALID(NULL);
+    if (i < 0 || i >= self->elem) {
+        PyErr_SetString(PyExc_IndexError, "smmap index out of range");
+        return NULL;
+    }
+    PREFETCH_RECORD(self, i);
+    return self->get(self->data, MMAP_INDEX(self, i));
+}
+
+static PyObject *
+mmap_slice(mmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh)
+{
+    PyObject *ret;
+    PyObject *item;
+    Py_ssize_t len;
+    Py_ssize_t i;
+
+    CHECK_VALID(NULL);
+    if (ilow < 0)
+        ilow = 0;
+    else if (ilow > self->elem)
+        ilow = self->elem;
+    if (ihigh < 0)
+        ihigh = 0;
+    if (ihigh < ilow)
+        ihigh = ilow;
+    else if (ihigh > self->elem)
+        ihigh = self->elem;
+
+    len = ihigh - ilow;
+    PREFETCH_RECORD(self, ihigh);
+
+    if ((ret = PyTuple_New(len)) == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < len; i++) {
+        item = self->get(self->data, MMAP_INDEX(self, i + ilow));
+        if (!item) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(ret, i, item);
+    }
+
+    return ret;
+}
+
+static PyObject *
+mmap_concat(mmap_object *self, PyObject *bb)
+{
+    CHECK_VALID(NULL);
+    PyErr_SetString(PyExc_SystemError,
+                    "smmaps don't support concatenation");
+    return NULL;
+}
+
+static PyObject *
+mmap_repeat(mmap_object *self, Py_ssize_t n)
+{
+    CHECK_VALID(NULL);
+    PyErr_SetString(PyExc_SystemError,
+                    "smmaps don't support repeat operation");
+    return NULL;
+}
+
+static int
+mmap_ass_slice(mmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *v)
+{
+    PyObject *seq;
+    PyObject **items;
+    Py_ssize_t i;
+    Py_ssize_t len;
+
+    CHECK_VALID(-1);
+    if (ilow < 0)
+        ilow = 0;
+    else if (ilow > self->elem)
+        ilow = self->elem;
+    if (ihigh < 0)
+        ihigh = 0;
+    if (ihigh < ilow)
+        ihigh = ilow;
+    else if (ihigh > self->elem)
+        ihigh = self->elem;
+
+    len = ihigh - ilow;
+
+    if (v == NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "smmap object doesn't support slice deletion");
+        return -1;
+    }
+    if ((seq = PySequence_Fast(v, "smmap slice assignment must be a sequence")) == NULL ) {
+        return -1;
+    }
+    if (PySequence_Fast_GET_SIZE(seq) != len) {
+        PyErr_SetString(PyExc_IndexError,
+                        "smmap slice assignment is wrong size");
+        Py_DECREF(seq);
+        return -1;
+    }
+    if (!is_writeable(self)) {
+        Py_DECREF(seq);
+        return -1;
+    }
+    PREFETCH_RECORD(self, ihigh);
+    items = PySequence_Fast_ITEMS(seq);
+    for(i = 0; i < len; i++) {
+        if (self->set(self->data, items[i], MMAP_INDEX(self, i + ilow)) == -1) {
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+static int
+mmap_ass_item(mmap_object *self, Py_ssize_t i, PyObject *v)
+{
+    CHECK_VALID(-1);
+    if (i < 0 || i >= self->elem) {
+        PyErr_SetString(PyExc_IndexError, "smmap index out of range");
+        return -1;
+    }
     if (v == NULL) {
         PyErr_SetString(PyExc_TypeError,
                         "smmap object doesn't support item deletion");
         return -1;
     }
-    if (!is_writeable(self))
+    if (!is_writeable(self))
+        return -1;
+    PREFETCH_RECORD(self, i);
+    return self->set(self->data, v, MMAP_INDEX(self, i));
+}
+
+static PySequenceMethods mmap_as_sequence = {
+    (lenfunc)mmap_length,                      /*sq_length*/
+    (binaryfunc)mmap_concat,                   /*sq_concat*/
+    (ssizeargfunc)mmap_repeat,                 /*sq_repeat*/
+    (ssizeargfunc)mmap_item,                           /*sq_item*/
+    (ssizessizeargfunc)mmap_slice,             /*sq_slice*/
+    (ssizeobjargproc)mmap_ass_item,            /*sq_ass_item*/
+    (ssizessizeobjargproc)mmap_ass_slice,      /*sq_ass_slice*/
+};
+
+static PyBufferProcs mmap_as_buffer = {
+    (readbufferproc)mmap_buffer_getreadbuf,
+    (writebufferproc)mmap_buffer_getwritebuf,
+    (segcountproc)mmap_buffer_getsegcount,
+    (charbufferproc)mmap_buffer_getcharbuffer,
+    (getbufferproc)mmap_buffer_getbuf,
+    (releasebufferproc)mmap_buffer_releasebuf,
+};
+
+static PyObject *
+new_mmap_object(PyTypeObject *type, PyObject *args, PyObject *kwdict);
+
+PyDoc_STRVAR(mmap_doc,
+"mmap(fileno, length, format[, access[, offset]])\n\
+\n\
+Maps length bytes from the file specified by the file descriptor fileno,\n\
+and returns a mmap object.\n\
+Format specifies the number format like in the struct module.\n\
+b signed char\n\
+B unsigned char\n\
+h short\n\
+H unsigned short\n\
+i int\n\
+I unsigned int\n\
+l long\n\
+L unsigned long\n\
+f float\n\
+d double\n\
+10, 12, 14 packed unsigned samples of that many bits, s10, s12, s14 signed\n\
+Whole byte formats may be preceded by a byte order character <, >, !, = or @.\n\
+offset may be any byte offset into the file.");
+
+
+static PyTypeObject mmap_object_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "smmap.mmap",                               /* tp_name */
+    sizeof(mmap_object),                        /* tp_size */
+    0,                                          /* tp_itemsize */
+    /* methods */
+    (destructor) mmap_object_dealloc,           /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    &mmap_as_sequence,                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    PyObject_GenericGetAttr,                    /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    &mmap_as_buffer,                            /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GETCHARBUFFER | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    mmap_doc,                                   /*tp_doc*/
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    mmap_object_methods,                        /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                      /* tp_init */
+    PyType_GenericAlloc,                        /* tp_alloc */
+    new_mmap_object,                            /* tp_new */
+    PyObject_Del,                           /* tp_free */
+};
+
+static void
+mmap_view_dealloc(mmap_object *m_obj)
+{
+    if (m_obj->data != NULL)
+        mmap_unexport(m_obj);
+    Py_XDECREF(m_obj->base);
+
+    Py_TYPE(m_obj)->tp_free((PyObject*)m_obj);
+}
+
+static PyObject *
+mmap_view_close_method(mmap_object *self, PyObject *unused)
+{
+    if (self->data != NULL) {
+        mmap_unexport(self);
+        self->data = NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static struct PyMethodDef mmap_view_methods[] = {
+    {"close",           (PyCFunction) mmap_view_close_method,   METH_NOARGS},
+    {NULL,         NULL}       /* sentinel */
+};
+
+PyDoc_STRVAR(mmap_view_doc,
+"View of a range of an smmap, created by mmap.view(start, stop[, step]).\n\
+\n\
+Shares the mapping of the smmap it was created from, which stays mapped\n\
+until the view is closed or deleted.");
+
+static PyTypeObject mmap_view_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "smmap.view",                               /* tp_name */
+    sizeof(mmap_object),                        /* tp_size */
+    0,                                          /* tp_itemsize */
+    /* methods */
+    (destructor) mmap_view_dealloc,             /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    &mmap_as_sequence,                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    PyObject_GenericGetAttr,                    /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    &mmap_as_buffer,                            /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GETCHARBUFFER | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    mmap_view_doc,                              /*tp_doc*/
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    mmap_view_methods,                          /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    &mmap_object_type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    0,                                      /* tp_init */
+    PyType_GenericAlloc,                        /* tp_alloc */
+    0,                                          /* tp_new */
+    PyObject_Del,                           /* tp_free */
+};
+
+static PyObject *
+mmap_view_method(mmap_object *self, PyObject *args)
+{
+    mmap_object *v_obj, *root;
+    PyObject *start, *stop, *step = Py_None, *slice;
+    Py_ssize_t istart, istop, istep, len;
+
+    CHECK_VALID(NULL);
+    if (!PyArg_ParseTuple(args, "OO|O:view", &start, &stop, &step))
+        return NULL;
+    if ((slice = PySlice_New(start, stop, step)) == NULL)
+        return NULL;
+    if (PySlice_GetIndicesEx((PySliceObject *)slice, self->elem,
+                             &istart, &istop, &istep, &len) < 0) {
+        Py_DECREF(slice);
+        return NULL;
+    }
+    Py_DECREF(slice);
+
+    v_obj = (mmap_object *)mmap_view_type.tp_alloc(&mmap_view_type, 0);
+    if (v_obj == NULL) {return NULL;}
+    root = MMAP_ROOT(self);
+    v_obj->data = self->data;
+    v_obj->elem = len;
+    v_obj->size = (size_t)((len * self->bits + 7) / 8);
+    v_obj->offset = self->offset;
+    v_obj->type = self->type;
+    memcpy(v_obj->format, self->format, sizeof(self->format));
+    v_obj->swapped = self->swapped;
+    v_obj->itemsize = self->itemsize;
+    v_obj->bits = self->bits;
+    v_obj->start = MMAP_INDEX(self, istart);
+    v_obj->step = self->step * istep;
+    v_obj->stride = v_obj->step * self->itemsize;
+    v_obj->access = self->access;
+    v_obj->get = self->get;
+    v_obj->set = self->set;
+    Py_INCREF(root);
+    v_obj->base = (PyObject *)root;
+    mmap_export(v_obj);
+    return (PyObject *)v_obj;
+}
+
+/* extract the map size from the given PyObject
+
+   Returns -1 on error, with an appropriate Python exception raised. On
+   success, the map size is returned. */
+static Py_ssize_t
+_GetMapSize(PyObject *o, const char* param)
+{
+    if (o == NULL)
+        return 0;
+    if (PyIndex_Check(o)) {
+        Py_ssize_t i = PyNumber_AsSsize_t(o, PyExc_OverflowError);
+        if (i==-1 && PyErr_Occurred())
+            return -1;
+        if (i < 0) {
+            PyErr_Format(PyExc_OverflowError,
+                            "memory mapped %s must be positive",
+                            param);
+            return -1;
+        }
+        return i;
+    }
+
+    PyErr_SetString(PyExc_TypeError, "map size must be an integral value");
+    return -1;
+}
+
+#ifdef HAVE_LARGEFILE_SUPPORT
+#define _Py_PARSE_OFF_T "L"
+#else
+#define _Py_PARSE_OFF_T "l"
+#endif
+
+/* Maps map_size elements of format from the file fd, starting at any byte
+   offset: the mapping starts at the page below offset. */
+static PyObject *
+mmap_from_fd(PyTypeObject *type, int fd, Py_ssize_t map_size,
+             const formatdef *format, int swapped, int access, off_t offset)
+{
+    mmap_object *m_obj;
+    int prot = PROT_WRITE | PROT_READ;
+    off_t skip = offset % sysconf(_SC_PAGESIZE);
+
+    switch ((access_mode)access) {
+    case ACCESS_READ:
+        prot = PROT_READ;
+        break;
+    case ACCESS_WRITE:
+        prot = PROT_READ | PROT_WRITE;
+        break;
+    case ACCESS_DEFAULT:
+        break;
+    default:
+        return PyErr_Format(PyExc_ValueError,
+                            "smmap invalid access parameter.");
+    }
+
+    m_obj = (mmap_object *)type->tp_alloc(type, 0);
+    if (m_obj == NULL) {return NULL;}
+    m_obj->data = NULL;
+    m_obj->prefetch = NULL;
+    m_obj->bits = format->bits ? format->bits : 8 * (int)format->size;
+    m_obj->size = (size_t) ((map_size * m_obj->bits + 7) / 8);
+    m_obj->offset = offset;
+    m_obj->map_size = m_obj->size + skip;
+    m_obj->map = mmap(NULL, m_obj->map_size,
+                      prot, MAP_SHARED,
+                      fd, offset - skip);
+    m_obj->get = format->get;
+    m_obj->set = format->set;
+    m_obj->elem = map_size;
+    m_obj->type = format->format;
+    m_obj->swapped = swapped;
+    if (format->bits)
+        strcpy(m_obj->format, "B");
+    else if (swapped)
+        sprintf(m_obj->format, "%c%c", SWAPPED_ORDER, format->format);
+    else
+        sprintf(m_obj->format, "%c", format->format);
+    m_obj->itemsize = format->size;
+    m_obj->start = 0;
+    m_obj->step = 1;
+    m_obj->stride = format->size;
+
+    if (m_obj->map == (void *)-1) {
+        m_obj->map = NULL;
+        Py_DECREF(m_obj);
+        PyErr_SetFromErrno(mmap_module_error);
+        return NULL;
+    }
+    m_obj->data = (char *)m_obj->map + skip;
+    m_obj->access = (access_mode)access;
+    return (PyObject *)m_obj;
+}
+
+static PyObject *
+new_mmap_object(PyTypeObject *type, PyObject *args, PyObject *kwdict)
+{
+    PyObject *map_size_obj = NULL;
+    Py_ssize_t map_size;
+    off_t offset = 0;
+    int fd, swapped;
+    int access = (int)ACCESS_DEFAULT;
+    char *fmt = " ";
+    const formatdef *format;
+    static char *keywords[] = {"fileno", "length", "format",
+                                     "access", "offset", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "iOs|i" _Py_PARSE_OFF_T, keywords,
+                                     &fd, &map_size_obj, &fmt,
+                                     &access, &offset))
+        return NULL;
+    map_size = _GetMapSize(map_size_obj, "size");
+    if (map_size < 0)
+        return NULL;
+    if (offset < 0) {
+        PyErr_SetString(PyExc_OverflowError,
+            "memory mapped offset must be positive");
+        return NULL;
+    }
+
+    if ((format = parse_format(fmt, &swapped)) == NULL) {
+        PyErr_SetString(PyExc_ValueError, "bad char in struct format");
+        return NULL;
+    }
+
+    return mmap_from_fd(type, fd, map_size, format, swapped, access, offset);
+}
+
+/* Files with a header
+
+   open_npy and open_wav parse the header of a file and map its payload in
+   place, with the format, byte order and length taken from the header. */
+
+static unsigned int
+load_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static int
+read_header(int fd, void *buf, size_t len, off_t offset)
+{
+    ssize_t n = pread(fd, buf, len, offset);
+
+    if (n < 0) {
+        PyErr_SetFromErrno(mmap_module_error);
+        return -1;
+    }
+    if ((size_t)n != len) {
+        PyErr_SetString(mmap_module_error, "file header is truncated");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+open_header_file(const char *path, int access)
+{
+    int fd = open(path, access == ACCESS_READ ? O_RDONLY : O_RDWR);
+
+    if (fd < 0)
+        PyErr_SetFromErrnoWithFilename(mmap_module_error, (char *)path);
+    return fd;
+}
+
+/* the format of a numpy type string like '<i2' */
+static const formatdef *
+npy_format(const char *descr, int *swapped)
+{
+    static const char *kinds[] = {"ibhil", "uBHIL", "ffd", NULL};
+    const formatdef *f;
+    const char **kind, *c;
+    char *end;
+    long size;
+
+    if (descr[0] == 0 || strchr("<>|=", descr[0]) == NULL || descr[1] == 0)
+        return NULL;
+    size = strtol(descr + 2, &end, 10);
+    if (*end != 0)
+        return NULL;
+    *swapped = (descr[0] == '<' || descr[0] == '>') &&
+               descr[0] != NATIVE_ORDER && size > 1;
+    for (kind = kinds; *kind != NULL; kind++) {
+        if ((*kind)[0] != descr[1])
+            continue;
+        for (c = *kind + 1; *c; c++) {
+            f = getentry(*c, *swapped ? swapped_table : format_table);
+            if (f->size == size)
+                return f;
+        }
+    }
+    return NULL;
+}
+
+PyDoc_STRVAR(open_npy_doc,
+"open_npy(path[, access])\n\
+\n\
+Maps the array of the .npy file path as a flat smmap in file order.\n\
+access defaults to ACCESS_READ.");
+
+static PyObject *
+smmap_open_npy(PyObject *module, PyObject *args)
+{
+    const char *path;
+    int access = ACCESS_READ, fd, swapped;
+    unsigned char pre[12];
+    size_t hlen, hoff;
+    char *header = NULL;
+    PyObject *ast = NULL, *dict = NULL, *descr, *shape, *order, *ret = NULL;
+    Py_ssize_t elem = 1, dim, k;
+    const formatdef *format;
+    struct stat st;
+
+    if (!PyArg_ParseTuple(args, "s|i:open_npy", &path, &access))
+        return NULL;
+    if ((fd = open_header_file(path, access)) < 0)
+        return NULL;
+
+    if (read_header(fd, pre, 10, 0) < 0)
+        goto done;
+    if (memcmp(pre, "\x93NUMPY", 6) != 0 || pre[6] < 1 || pre[6] > 3)
+        goto bad;
+    if (pre[6] == 1) {
+        hlen = pre[8] | pre[9] << 8;
+        hoff = 10;
+    }
+    else {
+        if (read_header(fd, pre, 12, 0) < 0)
+            goto done;
+        hlen = load_le32(pre + 8);
+        hoff = 12;
+    }
+    if ((header = PyMem_Malloc(hlen + 1)) == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (read_header(fd, header, hlen, hoff) < 0)
+        goto done;
+    header[hlen] = 0;
+
+    if ((ast = PyImport_ImportModule("ast")) == NULL)
+        goto done;
+    if ((dict = PyObject_CallMethod(ast, "literal_eval", "s", header)) == NULL) {
+        PyErr_Clear();
+        goto bad;
+    }
+    if (!PyDict_Check(dict) ||
+        (descr = PyDict_GetItemString(dict, "descr")) == NULL ||
+        (shape = PyDict_GetItemString(dict, "shape")) == NULL ||
+        !PyString_Check(descr) || !PyTuple_Check(shape))
+        goto bad;
+    if ((format = npy_format(PyString_AS_STRING(descr), &swapped)) == NULL) {
+        PyErr_Format(mmap_module_error, "unsupported .npy type '%s'",
+                     PyString_AS_STRING(descr));
+        goto done;
+    }
+    for (k = 0; k < PyTuple_GET_SIZE(shape); k++) {
+        dim = PyNumber_AsSsize_t(PyTuple_GET_ITEM(shape, k), PyExc_OverflowError);
+        if (dim == -1 && PyErr_Occurred())
+            goto done;
+        if (dim < 0)
+            goto bad;
+        if (dim > 0 && elem > PY_SSIZE_T_MAX / dim) {
+            PyErr_SetString(PyExc_OverflowError, ".npy array too large");
+            goto done;
+        }
+        elem *= dim;
+    }
+    /* the flat smmap is in file order, which is only the index order of a
+       C order array */
+    order = PyDict_GetItemString(dict, "fortran_order");
+    if (order != NULL && PyObject_IsTrue(order) && PyTuple_GET_SIZE(shape) > 1) {
+        PyErr_SetString(mmap_module_error,
+                        "Fortran order .npy arrays are not supported");
+        goto done;
+    }
+    if (fstat(fd, &st) != 0) {
+        PyErr_SetFromErrno(mmap_module_error);
+        goto done;
+    }
+    if ((off_t)(hoff + hlen) > st.st_size ||
+        elem > (st.st_size - (off_t)(hoff + hlen)) / format->size) {
+        PyErr_Format(mmap_module_error, ".npy file '%s' is truncated", path);
+        goto done;
+    }
+
+    ret = mmap_from_fd(&mmap_object_type, fd, elem, format, swapped, access,
+                       hoff + hlen);
+    goto done;
+
+  bad:
+    PyErr_SetString(mmap_module_error, "not a .npy file");
+  done:
+    close(fd);
+    PyMem_Free(header);
+    Py_XDECREF(ast);
+    Py_XDECREF(dict);
+    return ret;
+}
+
+PyDoc_STRVAR(open_wav_doc,
+"open_wav(path[, access]) -> (smmap, channels, rate)\n\
+\n\
+Maps the interleaved samples of the PCM or float WAV file path.\n\
+access defaults to ACCESS_READ.");
+
+static PyObject *
+smmap_open_wav(PyObject *module, PyObject *args)
+{
+    const char *path;
+    int access = ACCESS_READ, fd, swapped, have_fmt = 0;
+    unsigned char riff[12], chunk[8], fmt[40];
+    unsigned int tag = 0, channels = 0, rate = 0, bits = 0, size;
+    off_t off = 12, data_off;
+    unsigned long long data_size;
+    struct stat st;
+    const formatdef *format;
+    char descr[8];
+    PyObject *m_obj, *ret = NULL;
+
+    if (!PyArg_ParseTuple(args, "s|i:open_wav", &path, &access))
+        return NULL;
+    if ((fd = open_header_file(path, access)) < 0)
+        return NULL;
+
+    if (read_header(fd, riff, 12, 0) < 0)
+        goto done;
+    if (memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0)
+        goto bad;
+    for (;;) {
+        if (pread(fd, chunk, 8, off) != 8)
+            goto bad;
+        size = load_le32(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (size < 16 ||
+                read_header(fd, fmt, size < 40 ? size : 40, off + 8) < 0)
+                goto bad;
+            tag = fmt[0] | fmt[1] << 8;
+            channels = fmt[2] | fmt[3] << 8;
+            rate = load_le32(fmt + 4);
+            bits = fmt[14] | fmt[15] << 8;
+            /* WAVE_FORMAT_EXTENSIBLE keeps the format in its sub format */
+            if (tag == 0xfffe && size >= 26)
+                tag = fmt[24] | fmt[25] << 8;
+            have_fmt = 1;
+        }
+        else if (memcmp(chunk, "data", 4) == 0) {
+            data_off = off + 8;
+            data_size = size;
+            break;
+        }
+        off += 8 + size + (size & 1);
+    }
+    if (!have_fmt)
+        goto bad;
+
+    /* streamed files may leave the data size open */
+    if (fstat(fd, &st) != 0) {
+        PyErr_SetFromErrno(mmap_module_error);
+        goto done;
+    }
+    if (data_off > st.st_size)
+        goto bad;
+    if (data_size > (unsigned long long)(st.st_size - data_off))
+        data_size = st.st_size - data_off;
+
+    if (tag == 1 && bits == 8)
+        strcpy(descr, "|u1");
+    else if (tag == 1 && (bits == 16 || bits == 32))
+        sprintf(descr, "<i%u", bits / 8);
+    else if (tag == 3 && (bits == 32 || bits == 64))
+        sprintf(descr, "<f%u", bits / 8);
+    else {
+        PyErr_Format(mmap_module_error,
+                     "unsupported WAV format %u with %u bit samples", tag, bits);
+        goto done;
+    }
+    format = npy_format(descr, &swapped);
+
+    m_obj = mmap_from_fd(&mmap_object_type, fd, data_size / (bits / 8),
+                         format, swapped, access, data_off);
+    if (m_obj != NULL)
+        ret = Py_BuildValue("NII", m_obj, channels, rate);
+    goto done;
+
+  bad:
+    PyErr_SetString(mmap_module_error, "not a WAV file");
+  done:
+    close(fd);
+    return ret;
+}
+
+/* Compressed sample files
+
+   A compressed file stores the elements of a smmap in blocks of block_elems
+   elements.  Every block is delta coded on the integer representation of the
+   elements in native byte order (floats use their bit pattern, so the coding
+   is lossless; swapped elements are swapped before and after), the deltas
+   are zigzag coded and bit-packed with the smallest width that fits
+   the block.  All integers in the file are little-endian:
+
+     header   "SMZ1", format char, itemsize, 1 if the elements are not in
+              native byte order, pad byte, block_elems (u32),
+              elem (u64), nblocks (u64), 4 pad bytes          -> 32 bytes
+     index    nblocks + 1 offsets (u64) of the blocks from the file start
+     blocks   bit width (u8), first element, packed deltas of the others
+     padding  8 zero bytes, so the decoder may always load 8 bytes at once
+
+   cmmap maps such a file read-only and decodes only the blocks a request
+   touches into a small LRU cache of aligned buffers.  A worker thread can
+   decode the next blocks while the caller consumes the current one. */
+
+#define CMMAP_MAGIC         "SMZ1"
+#define CMMAP_HEADER        32
+#define CMMAP_PAD           8
+#define CMMAP_BLOCK         16384
+#define CMMAP_BLOCK_MAX     (1 << 20)
+#define CMMAP_CACHE         16
+
+/* load an item as an integer in native byte order */
+static unsigned long long
+load_item(const unsigned char *p, Py_ssize_t size, int swapped)
+{
+    unsigned char b;
+    unsigned short h;
+    unsigned int i;
+    unsigned long long l;
+
+    switch (size) {
+    case 1: b = *p; return b;
+    case 2: memcpy(&h, p, 2); return swapped ? __builtin_bswap16(h) : h;
+    case 4: memcpy(&i, p, 4); return swapped ? __builtin_bswap32(i) : i;
+    default: memcpy(&l, p, 8); return swapped ? __builtin_bswap64(l) : l;
+    }
+}
+
+static void
+store_item(unsigned char *p, Py_ssize_t size, unsigned long long x,
+           int swapped)
+{
+    unsigned short h = (unsigned short)x;
+    unsigned int i = (unsigned int)x;
+
+    switch (size) {
+    case 1: *p = (unsigned char)x; break;
+    case 2:
+        if (swapped) h = __builtin_bswap16(h);
+        memcpy(p, &h, 2);
+        break;
+    case 4:
+        if (swapped) i = __builtin_bswap32(i);
+        memcpy(p, &i, 4);
+        break;
+    default:
+        if (swapped) x = __builtin_bswap64(x);
+        memcpy(p, &x, 8);
+        break;
+    }
+}
+
+/* encode n > 0 elements of itemsize bytes from src into dst, which must hold
+   1 + n * itemsize + 8 bytes; returns the number of bytes used.  A block is
+   the bit width, the first element and the packed deltas of the others. */
+static size_t
+cblock_encode(const unsigned char *src, Py_ssize_t n, Py_ssize_t itemsize,
+              int swapped, unsigned char *dst)
+{
+    int bits = (int)itemsize * 8, shift = 64 - bits, width = 0, nacc = 0;
+    unsigned long long mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    unsigned long long prev, x, zz, acc = 0, any = 0;
+    unsigned char first[8];
+    unsigned char *out = dst + 1 + itemsize;
+    long long d;
+    Py_ssize_t k;
+
+    prev = load_item(src, itemsize, swapped);
+    for (k = 1; k < n; k++) {
+        x = load_item(src + k * itemsize, itemsize, swapped);
+        d = (long long)(((x - prev) & mask) << shift) >> shift;
+        any |= ((unsigned long long)d << 1) ^ (unsigned long long)(d >> 63);
+        prev = x;
+    }
+    while (width < 64 && (any >> width) != 0)
+        width++;
+    dst[0] = (unsigned char)width;
+    prev = load_item(src, itemsize, swapped);
+    store_le64(first, prev);
+    memcpy(dst + 1, first, itemsize);
+    if (width == 0)
+        return out - dst;
+
+    for (k = 1; k < n; k++) {
+        x = load_item(src + k * itemsize, itemsize, swapped);
+        d = (long long)(((x - prev) & mask) << shift) >> shift;
+        zz = ((unsigned long long)d << 1) ^ (unsigned long long)(d >> 63);
+        prev = x;
+
+        acc |= zz << nacc;
+        if (nacc + width >= 64) {
+            store_le64(out, acc);
+            out += 8;
+            acc = nacc ? zz >> (64 - nacc) : 0;
+            nacc = nacc + width - 64;
+        }
+        else
+            nacc += width;
+    }
+    if (nacc > 0) {
+        store_le64(out, acc);
+        out += (nacc + 7) / 8;
+    }
+    return out - dst;
+}
+
+/* decode n > 0 elements from the block at src of len bytes into dst; the
+   caller guarantees that CMMAP_PAD bytes after the block are readable */
+static int
+cblock_decode(const unsigned char *src, size_t len, Py_ssize_t n,
+              Py_ssize_t itemsize, int swapped, unsigned char *dst)
+{
+    int bits = (int)itemsize * 8, width, sh;
+    unsigned long long mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    unsigned long long wmask, prev, v;
+    size_t pos;
+    Py_ssize_t k;
+
+    if (len < 1 + (size_t)itemsize)
+        return -1;
+    width = src[0];
+    if (width > bits ||
+        len < 1 + itemsize + ((size_t)(n - 1) * width + 7) / 8)
         return -1;
-    return self->set(self->data, v, i);
+    wmask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+    prev = load_le64(src + 1) & mask;
+    store_item(dst, itemsize, prev, swapped);
+    src += 1 + itemsize;
+
+    for (k = 1; k < n; k++) {
+        if (width == 0) {
+            v = 0;
+        }
+        else {
+            pos = (size_t)(k - 1) * width;
+            sh = pos & 7;
+            v = load_le64(src + (pos >> 3)) >> sh;
+            if (sh + width > 64)
+                v |= (unsigned long long)src[(pos >> 3) + 8] << (64 - sh);
+            v &= wmask;
+        }
+        prev = (prev + ((v >> 1) ^ -(v & 1))) & mask;
+        store_item(dst + k * itemsize, itemsize, prev, swapped);
+    }
+    return 0;
 }
 
-static PySequenceMethods mmap_as_sequence = {
-    (lenfunc)mmap_length,                      /*sq_length*/
+enum {
+    CSLOT_EMPTY,
+    CSLOT_LOADING,
+    CSLOT_READY,
+};
+
+typedef struct {
+    Py_ssize_t      block;
+    int             state;
+    int             pins;
+    unsigned long   stamp;
+    unsigned char * buf;
+} cblock_slot;
+
+typedef struct {
+    PyObject_HEAD
+    unsigned char * data;           /* the compressed file */
+    size_t          size;
+    Py_ssize_t      elem;
+    Py_ssize_t      itemsize;
+    Py_ssize_t      block_elems;
+    Py_ssize_t      nblocks;
+    const unsigned char *index;
+    char            type;
+    int             swapped;
+
+    PyObject* (*get)(const void *, Py_ssize_t);
+
+    /* block cache, protected by lock */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    cblock_slot *   slots;
+    int             nslots;
+    unsigned long   clock;
+    Py_ssize_t      last_block;
+
+    /* decode ahead worker */
+    int             running;
+    int             stop;
+    pthread_t       thread;
+    Py_ssize_t      ahead;
+    Py_ssize_t      want;           /* next block the worker should decode */
+    Py_ssize_t      want_end;
+} cmmap_object;
+
+static Py_ssize_t
+cblock_elems(cmmap_object *self, Py_ssize_t b)
+{
+    Py_ssize_t n = self->elem - b * self->block_elems;
+    return n < self->block_elems ? n : self->block_elems;
+}
+
+static int
+cblock_decode_into(cmmap_object *self, Py_ssize_t b, unsigned char *dst)
+{
+    unsigned long long start = load_le64(self->index + 8 * b);
+    unsigned long long end = load_le64(self->index + 8 * (b + 1));
+
+    return cblock_decode(self->data + start, end - start,
+                         cblock_elems(self, b), self->itemsize, self->swapped,
+                         dst);
+}
+
+/* with lock held: slot caching block b or -1 */
+static int
+cblock_find(cmmap_object *self, Py_ssize_t b)
+{
+    int s;
+
+    for (s = 0; s < self->nslots; s++)
+        if (self->slots[s].block == b && self->slots[s].state != CSLOT_EMPTY)
+            return s;
+    return -1;
+}
+
+/* with lock held: least recently used slot that may be replaced or -1 */
+static int
+cblock_victim(cmmap_object *self)
+{
+    int s, victim = -1;
+
+    for (s = 0; s < self->nslots; s++) {
+        cblock_slot *slot = &self->slots[s];
+        if (slot->state == CSLOT_EMPTY)
+            return s;
+        if (slot->state == CSLOT_READY && slot->pins == 0 &&
+            (victim < 0 || slot->stamp < self->slots[victim].stamp))
+            victim = s;
+    }
+    return victim;
+}
+
+static void *
+cmmap_worker(void *arg)
+{
+    cmmap_object *self = (cmmap_object *)arg;
+    Py_ssize_t b;
+    int s, err;
+
+    pthread_mutex_lock(&self->lock);
+    while (!self->stop) {
+        if (self->want >= self->want_end) {
+            pthread_cond_wait(&self->cond, &self->lock);
+            continue;
+        }
+        b = self->want++;
+        if (cblock_find(self, b) >= 0 || (s = cblock_victim(self)) < 0)
+            continue;
+        self->slots[s].block = b;
+        self->slots[s].state = CSLOT_LOADING;
+        pthread_mutex_unlock(&self->lock);
+
+        err = cblock_decode_into(self, b, self->slots[s].buf);
+
+        pthread_mutex_lock(&self->lock);
+        self->slots[s].state = err ? CSLOT_EMPTY : CSLOT_READY;
+        self->slots[s].stamp = ++self->clock;
+        pthread_cond_broadcast(&self->cond);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+/* Returns the pinned slot holding block b, decoding it if necessary.  Sets an
+   exception and returns -1 on error.  Release with cblock_release. */
+static int
+cblock_acquire(cmmap_object *self, Py_ssize_t b)
+{
+    int s, err;
+
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        if ((s = cblock_find(self, b)) >= 0) {
+            if (self->slots[s].state == CSLOT_READY)
+                break;
+        }
+        else if ((s = cblock_victim(self)) >= 0) {
+            self->slots[s].block = b;
+            self->slots[s].state = CSLOT_LOADING;
+            pthread_mutex_unlock(&self->lock);
+
+            err = cblock_decode_into(self, b, self->slots[s].buf);
+
+            pthread_mutex_lock(&self->lock);
+            self->slots[s].state = err ? CSLOT_EMPTY : CSLOT_READY;
+            pthread_cond_broadcast(&self->cond);
+            if (err) {
+                pthread_mutex_unlock(&self->lock);
+                PyErr_Format(mmap_module_error,
+                             "corrupt compressed block %zd", b);
+                return -1;
+            }
+            break;
+        }
+        /* the worker is decoding the block or the only free slot */
+        pthread_cond_wait(&self->cond, &self->lock);
+    }
+    self->slots[s].pins++;
+    self->slots[s].stamp = ++self->clock;
+
+    if (b != self->last_block) {
+        if (self->running && b == self->last_block + 1) {
+            self->want = b + 1;
+            self->want_end = b + 1 + self->ahead;
+            if (self->want_end > self->nblocks)
+                self->want_end = self->nblocks;
+            pthread_cond_signal(&self->cond);
+        }
+        self->last_block = b;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return s;
+}
+
+static void
+cblock_release(cmmap_object *self, int s)
+{
+    pthread_mutex_lock(&self->lock);
+    self->slots[s].pins--;
+    pthread_mutex_unlock(&self->lock);
+}
+
+static void
+cmmap_free(cmmap_object *self)
+{
+    int s;
+
+    if (self->running) {
+        pthread_mutex_lock(&self->lock);
+        self->stop = 1;
+        pthread_cond_signal(&self->cond);
+        pthread_mutex_unlock(&self->lock);
+        pthread_join(self->thread, NULL);
+        self->running = 0;
+    }
+    if (self->slots != NULL) {
+        for (s = 0; s < self->nslots; s++)
+            free(self->slots[s].buf);
+        PyMem_Free(self->slots);
+        self->slots = NULL;
+    }
+    if (self->data != NULL) {
+        munmap(self->data, self->size);
+        self->data = NULL;
+    }
+}
+
+static void
+cmmap_object_dealloc(cmmap_object *self)
+{
+    cmmap_free(self);
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+cmmap_close_method(cmmap_object *self, PyObject *unused)
+{
+    cmmap_free(self);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static struct PyMethodDef cmmap_object_methods[] = {
+    {"close",           (PyCFunction) cmmap_close_method,       METH_NOARGS},
+    {NULL,         NULL}       /* sentinel */
+};
+
+static Py_ssize_t
+cmmap_length(cmmap_object *self)
+{
+    CHECK_VALID(-1);
+    return self->elem;
+}
+
+static PyObject *
+cmmap_item(cmmap_object *self, Py_ssize_t i)
+{
+    PyObject *ret;
+    int s;
+
+    CHECK_VALID(NULL);
+    if (i < 0 || i >= self->elem) {
+        PyErr_SetString(PyExc_IndexError, "smmap index out of range");
+        return NULL;
+    }
+    if ((s = cblock_acquire(self, i / self->block_elems)) < 0)
+        return NULL;
+    ret = self->get(self->slots[s].buf, i % self->block_elems);
+    cblock_release(self, s);
+    return ret;
+}
+
+static PyObject *
+cmmap_slice(cmmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh)
+{
+    PyObject *ret;
+    PyObject *item;
+    Py_ssize_t i, b, end;
+    int s;
+
+    CHECK_VALID(NULL);
+    if (ilow < 0)
+        ilow = 0;
+    else if (ilow > self->elem)
+        ilow = self->elem;
+    if (ihigh < 0)
+        ihigh = 0;
+    if (ihigh < ilow)
+        ihigh = ilow;
+    else if (ihigh > self->elem)
+        ihigh = self->elem;
+
+    if ((ret = PyTuple_New(ihigh - ilow)) == NULL) {
+        return NULL;
+    }
+
+    for (i = ilow; i < ihigh; ) {
+        b = i / self->block_elems;
+        end = (b + 1) * self->block_elems;
+        if (end > ihigh)
+            end = ihigh;
+        if ((s = cblock_acquire(self, b)) < 0) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        for (; i < end; i++) {
+            item = self->get(self->slots[s].buf, i - b * self->block_elems);
+            if (!item) {
+                cblock_release(self, s);
+                Py_DECREF(ret);
+                return NULL;
+            }
+            PyTuple_SET_ITEM(ret, i - ilow, item);
+        }
+        cblock_release(self, s);
+    }
+
+    return ret;
+}
+
+static int
+cmmap_ass_slice(cmmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *v)
+{
+    CHECK_VALID(-1);
+    PyErr_Format(PyExc_TypeError, "smmap can't modify a readonly memory map.");
+    return -1;
+}
+
+static int
+cmmap_ass_item(cmmap_object *self, Py_ssize_t i, PyObject *v)
+{
+    CHECK_VALID(-1);
+    PyErr_Format(PyExc_TypeError, "smmap can't modify a readonly memory map.");
+    return -1;
+}
+
+static PySequenceMethods cmmap_as_sequence = {
+    (lenfunc)cmmap_length,                     /*sq_length*/
     (binaryfunc)mmap_concat,                   /*sq_concat*/
     (ssizeargfunc)mmap_repeat,                 /*sq_repeat*/
-    (ssizeargfunc)mmap_item,                           /*sq_item*/
-    (ssizessizeargfunc)mmap_slice,             /*sq_slice*/
-    (ssizeobjargproc)mmap_ass_item,            /*sq_ass_item*/
-    (ssizessizeobjargproc)mmap_ass_slice,      /*sq_ass_slice*/
-};
-
-static PyBufferProcs mmap_as_buffer = {
-    (readbufferproc)mmap_buffer_getreadbuf,
-    (writebufferproc)mmap_buffer_getwritebuf,
-    (segcountproc)mmap_buffer_getsegcount,
-    (charbufferproc)mmap_buffer_getcharbuffer,
+    (ssizeargfunc)cmmap_item,                  /*sq_item*/
+    (ssizessizeargfunc)cmmap_slice,            /*sq_slice*/
+    (ssizeobjargproc)cmmap_ass_item,           /*sq_ass_item*/
+    (ssizessizeobjargproc)cmmap_ass_slice,     /*sq_ass_slice*/
 };
 
 static PyObject *
-new_mmap_object(PyTypeObject *type, PyObject *args, PyObject *kwdict);
+new_cmmap_object(PyTypeObject *type, PyObject *args, PyObject *kwdict);
 
-PyDoc_STRVAR(mmap_doc,
-"mmap(fileno, length, format[, access[, offset]])\n\
+PyDoc_STRVAR(cmmap_doc,
+"cmmap(fileno[, cache[, prefetch]])\n\
 \n\
-Maps length bytes from the file specified by the file descriptor fileno,\n\
-and returns a mmap object.\n\
-Format specifies the number format like in the struct module.\n\
-b signed char\n\
-B unsigned char\n\
-h short\n\
-H unsigned short\n\
-i int\n\
-I unsigned int\n\
-l long\n\
-L unsigned long\n\
-f float\n\
-d double");
+Maps the compressed file specified by the file descriptor fileno read-only,\n\
+and returns a sequence of its elements.  Blocks are decoded on demand into\n\
+a cache of cache blocks; if prefetch is given, a background thread decodes\n\
+that many blocks ahead of sequential readers.\n\
+Compressed files are created with smmap.compress.");
 
-
-static PyTypeObject mmap_object_type = {
+static PyTypeObject cmmap_object_type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "smmap.mmap",                               /* tp_name */
-    sizeof(mmap_object),                        /* tp_size */
+    "smmap.cmmap",                              /* tp_name */
+    sizeof(cmmap_object),                       /* tp_size */
     0,                                          /* tp_itemsize */
     /* methods */
-    (destructor) mmap_object_dealloc,           /* tp_dealloc */
+    (destructor) cmmap_object_dealloc,          /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
     0,                                          /* tp_compare */
     0,                                          /* tp_repr */
     0,                                          /* tp_as_number */
-    &mmap_as_sequence,                          /*tp_as_sequence*/
+    &cmmap_as_sequence,                         /*tp_as_sequence*/
     0,                                          /*tp_as_mapping*/
     0,                                          /*tp_hash*/
     0,                                          /*tp_call*/
     0,                                          /*tp_str*/
     PyObject_GenericGetAttr,                    /*tp_getattro*/
     0,                                          /*tp_setattro*/
-    &mmap_as_buffer,                            /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GETCHARBUFFER,                   /*tp_flags*/
-    mmap_doc,                                   /*tp_doc*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /*tp_flags*/
+    cmmap_doc,                                  /*tp_doc*/
     0,                                          /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
-    mmap_object_methods,                        /* tp_methods */
+    cmmap_object_methods,                       /* tp_methods */
     0,                                          /* tp_members */
     0,                                          /* tp_getset */
     0,                                          /* tp_base */
@@ -712,122 +4027,652 @@ static PyTypeObject mmap_object_type = {
     0,                                          /* tp_dictoffset */
     0,                                      /* tp_init */
     PyType_GenericAlloc,                        /* tp_alloc */
-    new_mmap_object,                            /* tp_new */
+    new_cmmap_object,                           /* tp_new */
     PyObject_Del,                           /* tp_free */
 };
 
+static PyObject *
+new_cmmap_object(PyTypeObject *type, PyObject *args, PyObject *kwdict)
+{
+    cmmap_object *m_obj;
+    int fd, cache = CMMAP_CACHE, ahead = 0, s, err;
+    struct stat st;
+    const unsigned char *h;
+    const formatdef *format;
+    unsigned long long elem, nblocks, block_elems, prev, off;
+    Py_ssize_t b, n;
+    static char *keywords[] = {"fileno", "cache", "prefetch", NULL};
 
-/* extract the map size from the given PyObject
+    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "i|ii", keywords,
+                                     &fd, &cache, &ahead))
+        return NULL;
+    if (ahead < 0 || cache < ahead + 2) {
+        PyErr_SetString(PyExc_ValueError,
+                        "cmmap requires cache >= prefetch + 2");
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0) {
+        PyErr_SetFromErrno(mmap_module_error);
+        return NULL;
+    }
 
-   Returns -1 on error, with an appropriate Python exception raised. On
-   success, the map size is returned. */
+    m_obj = (cmmap_object *)type->tp_alloc(type, 0);
+    if (m_obj == NULL) {return NULL;}
+    pthread_mutex_init(&m_obj->lock, NULL);
+    pthread_cond_init(&m_obj->cond, NULL);
+    m_obj->data = NULL;
+    m_obj->size = (size_t)st.st_size;
+    m_obj->last_block = -1;
+    if (m_obj->size < CMMAP_HEADER + 8 + CMMAP_PAD)
+        goto corrupt;
+    m_obj->data = mmap(NULL, m_obj->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m_obj->data == (void *)-1) {
+        m_obj->data = NULL;
+        Py_DECREF(m_obj);
+        PyErr_SetFromErrno(mmap_module_error);
+        return NULL;
+    }
+
+    h = m_obj->data;
+    if (memcmp(h, CMMAP_MAGIC, 4) != 0 ||
+        h[6] > 1 ||
+        (format = getentry(h[4], h[6] ? swapped_table : format_table)) == NULL ||
+        format->size != h[5])
+        goto corrupt;
+    block_elems = load_le64(h + 8) & 0xffffffffULL;
+    elem = load_le64(h + 12);
+    nblocks = load_le64(h + 20);
+    /* compress never writes blocks larger than the elements it holds */
+    if (block_elems == 0 || block_elems > CMMAP_BLOCK_MAX ||
+        block_elems > (elem > 0 ? elem : 1) ||
+        elem > PY_SSIZE_T_MAX / format->size ||
+        nblocks != (elem + block_elems - 1) / block_elems ||
+        nblocks > (m_obj->size - CMMAP_HEADER) / 8 - 1)
+        goto corrupt;
+
+    m_obj->type = format->format;
+    m_obj->swapped = h[6];
+    m_obj->get = format->get;
+    m_obj->itemsize = format->size;
+    m_obj->elem = (Py_ssize_t)elem;
+    m_obj->block_elems = (Py_ssize_t)block_elems;
+    m_obj->nblocks = (Py_ssize_t)nblocks;
+    m_obj->index = h + CMMAP_HEADER;
+    prev = load_le64(m_obj->index);
+    if (prev != CMMAP_HEADER + 8 * (nblocks + 1))
+        goto corrupt;
+    for (b = 0; b < m_obj->nblocks; b++) {
+        /* a block is at least the width and the first element and never
+           larger than its elements stored raw */
+        off = load_le64(m_obj->index + 8 * (b + 1));
+        n = cblock_elems(m_obj, b);
+        if (off < prev + 1 + format->size ||
+            off - prev > 1 + (unsigned long long)n * format->size ||
+            off > m_obj->size - CMMAP_PAD)
+            goto corrupt;
+        prev = off;
+    }
+
+    m_obj->slots = PyMem_Malloc(cache * sizeof(cblock_slot));
+    if (m_obj->slots == NULL) {
+        Py_DECREF(m_obj);
+        return PyErr_NoMemory();
+    }
+    memset(m_obj->slots, 0, cache * sizeof(cblock_slot));
+    m_obj->nslots = cache;
+    for (s = 0; s < cache; s++) {
+        m_obj->slots[s].block = -1;
+        if (posix_memalign((void **)&m_obj->slots[s].buf, 64,
+                           block_elems * format->size) != 0) {
+            m_obj->slots[s].buf = NULL;
+            Py_DECREF(m_obj);
+            return PyErr_NoMemory();
+        }
+    }
+
+    m_obj->ahead = ahead;
+    if (ahead > 0) {
+        if ((err = pthread_create(&m_obj->thread, NULL, cmmap_worker, m_obj)) != 0) {
+            Py_DECREF(m_obj);
+            errno = err;
+            PyErr_SetFromErrno(mmap_module_error);
+            return NULL;
+        }
+        m_obj->running = 1;
+    }
+    return (PyObject *)m_obj;
+
+  corrupt:
+    Py_DECREF(m_obj);
+    PyErr_SetString(mmap_module_error, "not a compressed smmap file");
+    return NULL;
+}
+
+PyDoc_STRVAR(compress_doc,
+"compress(smmap, fileno[, block])\n\
+\n\
+Writes the elements of smmap compressed to the file specified by the file\n\
+descriptor fileno, in blocks of block elements, for use with cmmap.");
+
+static PyObject *
+smmap_compress(PyObject *module, PyObject *args)
+{
+    mmap_object *src;
+    int fd, ok = 1;
+    Py_ssize_t block = CMMAP_BLOCK, nblocks, b, n, itemsize;
+    unsigned char header[CMMAP_HEADER], *index, *buf, *data;
+    unsigned long long pos;
+    size_t len;
+
+    if (!PyArg_ParseTuple(args, "O!i|n:compress", &mmap_object_type, &src,
+                          &fd, &block))
+        return NULL;
+    if (src->data == NULL) {
+        PyErr_SetString(PyExc_ValueError, "smmap closed or invalid");
+        return NULL;
+    }
+    if (src->itemsize == 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "compress doesn't support packed formats");
+        return NULL;
+    }
+    if ((data = (unsigned char *)mmap_bytes(src, 0, src->elem, &len)) == NULL)
+        return NULL;
+    if (block <= 0 || block > CMMAP_BLOCK_MAX) {
+        PyErr_SetString(PyExc_ValueError, "compress block size out of range");
+        return NULL;
+    }
+    if (block > src->elem)
+        block = src->elem > 0 ? src->elem : 1;
+    itemsize = src->itemsize;
+    nblocks = (src->elem + block - 1) / block;
+
+    index = PyMem_Malloc(8 * (nblocks + 1));
+    buf = PyMem_Malloc(1 + block * itemsize + CMMAP_PAD);
+    if (index == NULL || buf == NULL) {
+        PyMem_Free(index);
+        PyMem_Free(buf);
+        return PyErr_NoMemory();
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, CMMAP_MAGIC, 4);
+    header[4] = src->type;
+    header[5] = (unsigned char)itemsize;
+    header[6] = (unsigned char)src->swapped;
+    store_le64(buf, block);
+    memcpy(header + 8, buf, 4);
+    store_le64(header + 12, src->elem);
+    store_le64(header + 20, nblocks);
+
+    mmap_export(src);
+    Py_BEGIN_ALLOW_THREADS
+    pos = CMMAP_HEADER + 8 * (nblocks + 1);
+    for (b = 0; b < nblocks && ok; b++) {
+        store_le64(index + 8 * b, pos);
+        n = src->elem - b * block;
+        if (n > block)
+            n = block;
+        len = cblock_encode(data + b * block * itemsize, n, itemsize,
+                            src->swapped, buf);
+        ok = pwrite(fd, buf, len, pos) == (ssize_t)len;
+        pos += len;
+    }
+    store_le64(index + 8 * nblocks, pos);
+    memset(buf, 0, CMMAP_PAD);
+    ok = ok && pwrite(fd, buf, CMMAP_PAD, pos) == CMMAP_PAD &&
+         pwrite(fd, header, CMMAP_HEADER, 0) == CMMAP_HEADER &&
+         pwrite(fd, index, 8 * (nblocks + 1), CMMAP_HEADER) == 8 * (nblocks + 1) &&
+         ftruncate(fd, pos + CMMAP_PAD) == 0;
+    Py_END_ALLOW_THREADS
+    mmap_unexport(src);
+
+    PyMem_Free(index);
+    PyMem_Free(buf);
+    if (!ok)
+        return PyErr_SetFromErrno(mmap_module_error);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Transcoding
+
+   transcode converts the elements of one smmap into the format of another
+   in blocks of TRANSCODE_BLOCK elements: one typed loop loads a block of the
+   source into 64-bit integers or doubles, the next checks or saturates them
+   against the range of the destination and a last one stores them.  For
+   contiguous native elements the compiler vectorizes the loads of integers
+   up to 32 bits and the stores of integers; 64-bit loads, the range checks
+   and the conversions between integers and floats or doubles stay scalar,
+   as SSE2 has no 64-bit integer conversions for the 64-bit values of the
+   blocks. */
+
+#define TRANSCODE_BLOCK     2048
+#define TRANSCODE_RELEASE   (1 << 20)   /* elements */
+
+typedef union {
+    long long           i;
+    unsigned long long  u;
+    double              d;
+} tc_value;
+
+enum {
+    TC_SIGNED,
+    TC_UNSIGNED,
+    TC_FLOAT,
+};
+
+/* range of an integer destination; doubles d fit if lo_d - 1 < d < hi_d */
+typedef struct {
+    long long           lo;
+    long long           hi_s;
+    unsigned long long  hi_u;
+    double              lo_d;
+    double              hi_d;
+} tc_range;
+
+typedef struct {
+    mmap_object *src;
+    mmap_object *dst;
+    Py_ssize_t  lo;
+    Py_ssize_t  hi;
+    int         kind;
+    int         saturate;
+    tc_range    range;
+    Py_ssize_t *bad;            /* first element out of range, shared */
+    int         nomem;
+} transcode_part;
+
+#define bswap_none(x)   (x)
+#define bswap_short(x)  __builtin_bswap16(x)
+#define bswap_int(x)    __builtin_bswap32(x)
+#if (SIZEOF_LONG > SIZEOF_INT)
+#define bswap_long(x)   __builtin_bswap64(x)
+#else
+#define bswap_long(x)   __builtin_bswap32(x)
+#endif
+
+static int
+tc_kind(mmap_object *self)
+{
+    if (self->type == 'f' || self->type == 'd')
+        return TC_FLOAT;
+    if (self->type == 'L')
+        return TC_UNSIGNED;
+    return TC_SIGNED;
+}
+
+static void
+tc_range_init(mmap_object *self, tc_range *r)
+{
+    int bits = self->itemsize ? 8 * (int)self->itemsize : self->bits;
+    int is_signed = strchr("bhils", self->type) != NULL;
+
+    if (is_signed) {
+        r->hi_u = (1ULL << (bits - 1)) - 1;
+        r->lo = -(long long)r->hi_u - 1;
+    }
+    else {
+        r->hi_u = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+        r->lo = 0;
+    }
+    r->hi_s = r->hi_u > (unsigned long long)LLONG_MAX ? LLONG_MAX : (long long)r->hi_u;
+    r->lo_d = (double)r->lo;
+    r->hi_d = ldexp(1.0, is_signed ? bits - 1 : bits);
+}
+
+#define TC_LOAD(ctype, utype, swap, member)                             \
+    for (k = 0; k < n; k++) {                                           \
+        ctype c_ = ((const ctype *)p)[idx + k * step];                  \
+        if (sw) {                                                       \
+            utype u_;                                                   \
+            memcpy(&u_, &c_, sizeof(u_));                               \
+            u_ = swap(u_);                                              \
+            memcpy(&c_, &u_, sizeof(c_));                               \
+        }                                                               \
+        v[k].member = c_;                                               \
+    }                                                                   \
+    break;
+
+static void
+tc_load(mmap_object *self, Py_ssize_t i, Py_ssize_t n, tc_value *v)
+{
+    const char *p = self->data;
+    Py_ssize_t idx = MMAP_INDEX(self, i), step = self->step, k;
+    int sw = self->swapped, shift = 64 - self->bits;
+
+    if (self->itemsize == 0) {
+        for (k = 0; k < n; k++) {
+            unsigned long long x = packed_load((const unsigned char *)p,
+                                               idx + k * step, self->bits);
+            v[k].i = self->type == 's' ? (long long)(x << shift) >> shift
+                                       : (long long)x;
+        }
+        return;
+    }
+    switch (self->type) {
+    case 'b': TC_LOAD(signed char, unsigned char, bswap_none, i)
+    case 'B': TC_LOAD(unsigned char, unsigned char, bswap_none, i)
+    case 'h': TC_LOAD(short, unsigned short, bswap_short, i)
+    case 'H': TC_LOAD(unsigned short, unsigned short, bswap_short, i)
+    case 'i': TC_LOAD(int, unsigned int, bswap_int, i)
+    case 'I': TC_LOAD(unsigned int, unsigned int, bswap_int, i)
+    case 'l': TC_LOAD(long, unsigned long, bswap_long, i)
+    case 'L': TC_LOAD(unsigned long, unsigned long, bswap_long, u)
+    case 'f': TC_LOAD(float, unsigned int, bswap_int, d)
+    case 'd': TC_LOAD(double, unsigned long long, __builtin_bswap64, d)
+    }
+}
+
+#define TC_FITS(kind, r, x)                                             \
+    ((kind) == TC_SIGNED ? (x).i >= (r)->lo && (x).i <= (r)->hi_s :     \
+     (kind) == TC_UNSIGNED ? (x).u <= (r)->hi_u :                       \
+     ((x).d > (r)->lo_d - 1.0 || (x).d == (r)->lo_d) && (x).d < (r)->hi_d)
+
+/* Replaces the values by the bits of the integers the destination gets,
+   truncated toward zero and saturated like this:  without saturate only up
+   to the first value out of range, whose index is returned (n if none). */
 static Py_ssize_t
-_GetMapSize(PyObject *o, const char* param)
+tc_fit(const tc_range *r, int kind, int saturate, tc_value *v, Py_ssize_t n)
 {
-    if (o == NULL)
-        return 0;
-    if (PyIndex_Check(o)) {
-        Py_ssize_t i = PyNumber_AsSsize_t(o, PyExc_OverflowError);
-        if (i==-1 && PyErr_Occurred())
-            return -1;
-        if (i < 0) {
-            PyErr_Format(PyExc_OverflowError,
-                            "memory mapped %s must be positive",
-                            param);
-            return -1;
+    Py_ssize_t k;
+    int bad = 0;
+
+    if (!saturate) {
+        switch (kind) {
+        case TC_SIGNED:
+            for (k = 0; k < n; k++)
+                bad |= !TC_FITS(TC_SIGNED, r, v[k]);
+            break;
+        case TC_UNSIGNED:
+            for (k = 0; k < n; k++)
+                bad |= !TC_FITS(TC_UNSIGNED, r, v[k]);
+            break;
+        default:
+            for (k = 0; k < n; k++)
+                bad |= !TC_FITS(TC_FLOAT, r, v[k]);
+            break;
         }
-        return i;
+        if (bad)
+            for (k = 0; k < n; k++)
+                if (!TC_FITS(kind, r, v[k])) {
+                    n = k;
+                    break;
+                }
     }
 
-    PyErr_SetString(PyExc_TypeError, "map size must be an integral value");
-    return -1;
+    switch (kind) {
+    case TC_SIGNED:
+        for (k = 0; k < n; k++)
+            v[k].i = v[k].i < r->lo ? r->lo : v[k].i > r->hi_s ? r->hi_s : v[k].i;
+        break;
+    case TC_UNSIGNED:
+        for (k = 0; k < n; k++)
+            v[k].u = v[k].u > r->hi_u ? r->hi_u : v[k].u;
+        break;
+    default:
+        for (k = 0; k < n; k++) {
+            double d = v[k].d;
+            if (d != d)
+                v[k].u = 0;
+            else if (d >= r->hi_d)
+                v[k].u = r->hi_u;
+            else if (d >= 9223372036854775808.0)
+                v[k].u = (unsigned long long)d;
+            else if (d > r->lo_d - 1.0)
+                v[k].i = (long long)d;
+            else
+                v[k].i = r->lo;
+        }
+        break;
+    }
+    return n;
 }
 
-static const formatdef *
-getentry(int c, const formatdef *f)
+#define TC_STORE(ctype, utype, swap, member)                            \
+    for (k = 0; k < n; k++) {                                           \
+        ctype c_ = (ctype)v[k].member;                                  \
+        if (sw) {                                                       \
+            utype u_;                                                   \
+            memcpy(&u_, &c_, sizeof(u_));                               \
+            u_ = swap(u_);                                              \
+            memcpy(&c_, &u_, sizeof(c_));                               \
+        }                                                               \
+        ((ctype *)p)[idx + k * step] = c_;                              \
+    }                                                                   \
+    break;
+
+/* stores integer bits, or doubles for the float formats */
+static void
+tc_store(mmap_object *self, Py_ssize_t i, Py_ssize_t n, const tc_value *v)
 {
-    for (; f->format != '\0'; f++) {
-        if (f->format == c) {
-            return f;
+    char *p = self->data;
+    Py_ssize_t idx = MMAP_INDEX(self, i), step = self->step, k;
+    int sw = self->swapped;
+
+    if (self->itemsize == 0) {
+        for (k = 0; k < n; k++)
+            packed_store((unsigned char *)p, idx + k * step, self->bits,
+                         (unsigned int)v[k].u);
+        return;
+    }
+    switch (self->type) {
+    case 'b': TC_STORE(signed char, unsigned char, bswap_none, u)
+    case 'B': TC_STORE(unsigned char, unsigned char, bswap_none, u)
+    case 'h': TC_STORE(short, unsigned short, bswap_short, u)
+    case 'H': TC_STORE(unsigned short, unsigned short, bswap_short, u)
+    case 'i': TC_STORE(int, unsigned int, bswap_int, u)
+    case 'I': TC_STORE(unsigned int, unsigned int, bswap_int, u)
+    case 'l': TC_STORE(long, unsigned long, bswap_long, u)
+    case 'L': TC_STORE(unsigned long, unsigned long, bswap_long, u)
+    case 'f': TC_STORE(float, unsigned int, bswap_int, d)
+    case 'd': TC_STORE(double, unsigned long long, __builtin_bswap64, d)
+    }
+}
+
+/* madvise the pages inside (MADV_DONTNEED) or covering (others) the bytes
+   of the elements ilow:ihigh */
+static void
+mmap_advise(mmap_object *self, Py_ssize_t ilow, Py_ssize_t ihigh, int advice)
+{
+    mmap_object *root = MMAP_ROOT(self);
+    uintptr_t page = sysconf(_SC_PAGESIZE), a, b;
+    char *begin, *end;
+
+    if (ilow >= ihigh)
+        return;
+    mmap_extent(self, ilow, ihigh, &begin, &end);
+    if (advice != MADV_DONTNEED) {
+        a = (uintptr_t)begin & ~(page - 1);
+        b = ((uintptr_t)end + page - 1) & ~(page - 1);
+        if (b > (uintptr_t)root->map + root->map_size)
+            b = (uintptr_t)root->map + root->map_size;
+    }
+    else {
+        a = ((uintptr_t)begin + page - 1) & ~(page - 1);
+        b = (uintptr_t)end & ~(page - 1);
+    }
+    if (a < b)
+        madvise((void *)a, b - a, advice);
+}
+
+/* MADV_SEQUENTIAL lets the kernel read ahead and reclaim the pages of the
+   range soon after they were touched.  MADV_DONTNEED behind the cursor only
+   drops our page table entries, so the resident set of a conversion larger
+   than memory stays bounded; on these shared mappings the pages themselves,
+   dirty ones included, stay in the page cache until writeback and reclaim.
+   The ranges are advised MADV_NORMAL again when done.  Parts behind a value
+   out of range stop, the ones in front of it finish. */
+static void *
+transcode_worker(void *arg)
+{
+    transcode_part *part = (transcode_part *)arg;
+    mmap_object *src = part->src, *dst = part->dst;
+    Py_ssize_t i, n, m, released = part->lo;
+    tc_value *v;
+
+    if (part->lo >= part->hi)
+        return NULL;
+    if ((v = malloc(TRANSCODE_BLOCK * sizeof(tc_value))) == NULL) {
+        part->nomem = 1;
+        return NULL;
+    }
+    mmap_advise(src, part->lo, part->hi, MADV_SEQUENTIAL);
+    mmap_advise(dst, part->lo, part->hi, MADV_SEQUENTIAL);
+    for (i = part->lo; i < part->hi; i += n) {
+        if (i > __atomic_load_n(part->bad, __ATOMIC_RELAXED))
+            break;
+        n = part->hi - i < TRANSCODE_BLOCK ? part->hi - i : TRANSCODE_BLOCK;
+        tc_load(src, i, n, v);
+        m = n;
+        if (dst->type != 'f' && dst->type != 'd')
+            m = tc_fit(&part->range, part->kind, part->saturate, v, n);
+        else if (part->kind == TC_SIGNED)
+            for (m = 0; m < n; m++)
+                v[m].d = (double)v[m].i;
+        else if (part->kind == TC_UNSIGNED)
+            for (m = 0; m < n; m++)
+                v[m].d = (double)v[m].u;
+        tc_store(dst, i, m, v);
+        if (m < n) {
+            Py_ssize_t bad = __atomic_load_n(part->bad, __ATOMIC_RELAXED);
+            while (i + m < bad &&
+                   !__atomic_compare_exchange_n(part->bad, &bad, i + m, 1,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED))
+                ;
+            break;
+        }
+        if (i + n - released >= TRANSCODE_RELEASE) {
+            mmap_advise(src, released, i + n, MADV_DONTNEED);
+            if (dst != src)
+                mmap_advise(dst, released, i + n, MADV_DONTNEED);
+            released = i + n;
         }
     }
+    mmap_advise(src, part->lo, part->hi, MADV_NORMAL);
+    mmap_advise(dst, part->lo, part->hi, MADV_NORMAL);
+    free(v);
     return NULL;
 }
 
-#ifdef HAVE_LARGEFILE_SUPPORT
-#define _Py_PARSE_OFF_T "L"
-#else
-#define _Py_PARSE_OFF_T "l"
-#endif
+PyDoc_STRVAR(transcode_doc,
+"transcode(src, dst[, saturate[, threads]])\n\
+\n\
+Converts the elements of the smmap src into the format of the smmap dst,\n\
+which must have the same length. Values out of range for dst raise the\n\
+error of item assignment, or are clamped with saturate.");
 
 static PyObject *
-new_mmap_object(PyTypeObject *type, PyObject *args, PyObject *kwdict)
+smmap_transcode(PyObject *module, PyObject *args, PyObject *kwdict)
 {
-    mmap_object *m_obj;
-    PyObject *map_size_obj = NULL;
-    Py_ssize_t map_size;
-    off_t offset = 0;
-    int fd, prot = PROT_WRITE | PROT_READ;
-    int access = (int)ACCESS_DEFAULT;
-    char *fmt = " ";
-    const formatdef *format;
-    static char *keywords[] = {"fileno", "length", "format",
-                                     "access", "offset", NULL};
+    mmap_object *src, *dst;
+    transcode_part part[MAX_THREADS];
+    Py_ssize_t n, align = 1, bad = PY_SSIZE_T_MAX;
+    int saturate = 0, threads = 1, t, nomem = 0;
+    char *sb, *se, *db, *de;
+    static char *keywords[] = {"src", "dst", "saturate", "threads", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "iOs|iii" _Py_PARSE_OFF_T, keywords,
-                                     &fd, &map_size_obj, &fmt, &prot,
-                                     &access, &offset))
+    if (!PyArg_ParseTupleAndKeywords(args, kwdict, "O!O!|ii:transcode",
+                                     keywords, &mmap_object_type, &src,
+                                     &mmap_object_type, &dst, &saturate,
+                                     &threads))
         return NULL;
-    map_size = _GetMapSize(map_size_obj, "size");
-    if (map_size < 0)
+    if (src->data == NULL || dst->data == NULL) {
+        PyErr_SetString(PyExc_ValueError, "smmap closed or invalid");
         return NULL;
-    if (offset < 0) {
-        PyErr_SetString(PyExc_OverflowError,
-            "memory mapped offset must be positive");
+    }
+    if (!is_writeable(dst))
+        return NULL;
+    if ((n = src->elem) != dst->elem) {
+        PyErr_SetString(PyExc_ValueError,
+                        "transcode requires smmaps of the same length");
         return NULL;
     }
-
-    if (fmt == NULL || *fmt == 0 || (format = getentry(*fmt, format_table)) == NULL) {
-        PyErr_SetString(PyExc_ValueError, "bad char in struct format");
+    if (n == 0) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    /* in place only element by element */
+    mmap_extent(src, 0, n, &sb, &se);
+    mmap_extent(dst, 0, n, &db, &de);
+    if (sb < de && db < se &&
+        (src->data != dst->data || src->start != dst->start ||
+         src->step != dst->step || src->itemsize != dst->itemsize ||
+         src->bits != dst->bits)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "transcode source and destination overlap");
         return NULL;
     }
+    if (tc_kind(src) == TC_FLOAT && dst->type != 'f' && dst->type != 'd' &&
+        !saturate && PyErr_WarnEx(PyExc_DeprecationWarning,
+                                  FLOAT_COERCE_WARN, 1) < 0)
+        return NULL;
 
-    switch ((access_mode)access) {
-    case ACCESS_READ:
-        prot = PROT_READ;
-        break;
-    case ACCESS_WRITE:
-        prot = PROT_READ | PROT_WRITE;
-        break;
-    case ACCESS_DEFAULT:
-        break;
-    default:
-        return PyErr_Format(PyExc_ValueError,
-                            "smmap invalid access parameter.");
+    if (threads < 1)
+        threads = 1;
+    else if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    /* packed elements of different threads must not share a byte */
+    if (dst->itemsize == 0) {
+        if (dst->step != 1)
+            threads = 1;
+        align = 8;
+    }
+    for (t = 0; t < threads; t++) {
+        part[t].src = src;
+        part[t].dst = dst;
+        part[t].lo = t == 0 ? 0 : (dst->start + n * t / threads) / align * align - dst->start;
+        part[t].hi = n;
+        part[t].kind = tc_kind(src);
+        part[t].saturate = saturate;
+        tc_range_init(dst, &part[t].range);
+        part[t].bad = &bad;
+        part[t].nomem = 0;
+        if (part[t].lo < 0)
+            part[t].lo = 0;
+        if (t > 0)
+            part[t - 1].hi = part[t].lo;
     }
 
-    m_obj = (mmap_object *)type->tp_alloc(type, 0);
-    if (m_obj == NULL) {return NULL;}
-    m_obj->data = NULL;
-    m_obj->size = (size_t) (map_size * format->size);
-    m_obj->offset = offset;
-    m_obj->data = mmap(NULL, m_obj->size,
-                       prot, MAP_SHARED,
-                       fd, offset);
-    m_obj->get = format->get;
-    m_obj->set = format->set;
-    m_obj->elem = map_size;
+    mmap_export(src);
+    mmap_export(dst);
+    Py_BEGIN_ALLOW_THREADS
+    run_threads(transcode_worker, part, sizeof(transcode_part), threads);
+    Py_END_ALLOW_THREADS
+    mmap_unexport(dst);
+    mmap_unexport(src);
 
-    if (m_obj->data == (void *)-1) {
-        m_obj->data = NULL;
-        Py_DECREF(m_obj);
-        PyErr_SetFromErrno(mmap_module_error);
+    for (t = 0; t < threads; t++)
+        nomem |= part[t].nomem;
+    if (nomem)
+        return PyErr_NoMemory();
+    if (bad != PY_SSIZE_T_MAX) {
+        /* let the setter of dst raise its error for the value */
+        PyObject *item = src->get(src->data, MMAP_INDEX(src, bad));
+        swapbuf x;
+
+        if (item != NULL) {
+            memset(&x, 0, sizeof(x));
+            if (dst->set(x.b, item, 0) == 0)
+                PyErr_SetString(PyExc_ValueError,
+                                "transcode value out of range");
+            Py_DECREF(item);
+        }
         return NULL;
     }
-    m_obj->access = (access_mode)access;
-    return (PyObject *)m_obj;
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
+static struct PyMethodDef smmap_functions[] = {
+    {"compress",        (PyCFunction) smmap_compress,   METH_VARARGS, compress_doc},
+    {"open_npy",        (PyCFunction) smmap_open_npy,   METH_VARARGS, open_npy_doc},
+    {"open_wav",        (PyCFunction) smmap_open_wav,   METH_VARARGS, open_wav_doc},
+    {"transcode",       (PyCFunction) smmap_transcode,  METH_VARARGS | METH_KEYWORDS, transcode_doc},
+    {NULL,         NULL}       /* sentinel */
+};
+
 static void
 setint(PyObject *d, const char *name, long value)
 {
@@ -842,10 +4687,23 @@ initsmmap(void)
 {
     PyObject *dict, *module;
 
+    crc32c_init();
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c = crc32c_hw;
+    have_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
     if (PyType_Ready(&mmap_object_type) < 0)
         return;
+    if (PyType_Ready(&mmap_view_type) < 0)
+        return;
+    /* views are only created by mmap.view */
+    mmap_view_type.tp_new = NULL;
+    if (PyType_Ready(&cmmap_object_type) < 0)
+        return;
 
-    module = Py_InitModule("smmap", NULL);
+    module = Py_InitModule("smmap", smmap_functions);
     if (module == NULL)
         return;
     dict = PyModule_GetDict(module);
@@ -857,6 +4715,8 @@ initsmmap(void)
         return;
     PyDict_SetItemString(dict, "error", mmap_module_error);
     PyDict_SetItemString(dict, "mmap", (PyObject*) &mmap_object_type);
+    PyDict_SetItemString(dict, "view", (PyObject*) &mmap_view_type);
+    PyDict_SetItemString(dict, "cmmap", (PyObject*) &cmmap_object_type);
 
     setint(dict, "ACCESS_READ", ACCESS_READ);
     setint(dict, "ACCESS_WRITE", ACCESS_WRITE);
@@ -1,5 +1,13 @@
+import array
+import os
+import struct
+import tempfile
+import warnings
 import smmap
 
+if not os.path.exists('data'):
+    open('data', 'wb').write('\0' * 20)
+
 f = open('data' ,'r+')
 x = smmap.mmap(f.fileno(), 10, 'h')
 print x[0]
@@ -7,4 +15,310 @@ print x[0:3]
 x[1]=5
 x[2]=-5
 x[5:7] = (2,3)
-x[5:7] = (2,3,4)
+try:
+    x[5:7] = (2,3,4)
+except IndexError as e:
+    print e
+
+
+def datafile(nbytes):
+    f = tempfile.TemporaryFile()
+    f.truncate(nbytes)
+    return f
+
+# readahead
+f = datafile(1 << 20)
+m = smmap.mmap(f.fileno(), 1 << 19, 'h')
+m[0:1000] = range(1000)
+m.prefetch(256)
+assert m[0:1000] == tuple(range(1000))
+assert sum(m[i] for i in range(0, 1 << 19, 256)) == sum(range(0, 1000, 256))
+m.prefetch(64, 1024)
+m.prefetch(0)
+m.prefetch(64)
+v = m.view(0, 1000)
+m.close()
+try:
+    v.prefetch(64)
+    assert False
+except ValueError:
+    pass
+print 'prefetch ok'
+
+# compress -> cmmap round trip
+for fmt, vals in (('h', [(i * 37) % 2000 - 1000 for i in range(50000)]),
+                  ('>i', [i * i - 10 ** 9 for i in range(50000)]),
+                  ('d', [i / 7.0 for i in range(50000)])):
+    f = datafile(len(vals) * 8)
+    m = smmap.mmap(f.fileno(), len(vals), fmt)
+    m[0:len(vals)] = vals
+    c = tempfile.TemporaryFile()
+    smmap.compress(m, c.fileno(), 1000)
+    cm = smmap.cmmap(c.fileno(), 4, 2)
+    assert len(cm) == len(vals)
+    assert cm[0:len(vals)] == tuple(vals)
+    assert cm[-1] == vals[-1] and cm[12345] == vals[12345]
+    assert list(cm[i] for i in range(999, 5000, 1000)) == vals[999:5000:1000]
+    cm.close()
+
+# byte-swapped elements are delta coded in native order
+f = datafile(80000)
+m = smmap.mmap(f.fileno(), 40000, '>h')
+m[0:40000] = [i // 4 - 5000 for i in range(40000)]
+c = tempfile.TemporaryFile()
+smmap.compress(m, c.fileno())
+assert os.fstat(c.fileno()).st_size < 80000 / 4
+assert smmap.cmmap(c.fileno())[0:40000] == m[0:40000]
+
+# headers with blocks larger than the elements or bad block lengths
+f = datafile(20)
+m = smmap.mmap(f.fileno(), 10, 'h')
+m[0:10] = range(10)
+for pos, patch in ((8, '\xff\xff\xff\xff'), (40, '\x22')):
+    c = tempfile.TemporaryFile()
+    smmap.compress(m, c.fileno(), 5)
+    c.seek(pos)
+    c.write(patch)
+    c.flush()
+    try:
+        smmap.cmmap(c.fileno())
+        assert False
+    except smmap.error:
+        pass
+print 'cmmap ok'
+
+# views
+f = datafile(200)
+m = smmap.mmap(f.fileno(), 100, 'h')
+m[0:100] = range(100)
+v = m.view(10, 90, 3)
+assert v[0:len(v)] == tuple(range(10, 90, 3))
+v[1] = -1
+assert m[13] == -1
+w = v.view(None, None, -2)
+assert w[0:len(w)] == tuple(v[0:len(v)][::-2])
+assert memoryview(m.view(0, 4)).tobytes() == struct.pack('4h', 0, 1, 2, 3)
+m.close()
+assert v[0] == 10
+del v, w
+print 'view ok'
+
+# checksums
+f = datafile(9)
+f.write('123456789')
+f.flush()
+m = smmap.mmap(f.fileno(), 9, 'B')
+assert m.checksum('crc32c') == 0xe3069283
+assert m.checksum('xxh64') == 0x8cb841db40e6ae83
+assert m.checksum('xxh64', 0, 0) == 0xef46db3751d8e999
+f = datafile(1 << 20)
+m = smmap.mmap(f.fileno(), 1 << 18, 'i')
+m[0:1 << 18] = [i * 2654435761 % (1 << 31) for i in range(1 << 18)]
+crc = m.checksum('crc32c')
+for threads in (2, 3, 7):
+    assert m.checksum('crc32c', threads=threads) == crc
+assert m.checksum('crc32c', 1000, 50000, 4) == m.checksum('crc32c', 1000, 50000)
+assert m.checksum('xxh64', tree=True, threads=4, chunk=4096) == \
+    m.checksum('xxh64', tree=True, chunk=4096)
+print 'checksum ok'
+
+# packed samples against a bit-level reference
+def bitpack(vals, bits):
+    acc = 0
+    for i, v in enumerate(vals):
+        acc |= (v & ((1 << bits) - 1)) << (i * bits)
+    n = (len(vals) * bits + 7) // 8
+    return ''.join(chr((acc >> (8 * k)) & 0xff) for k in range(n))
+
+for fmt, bits, sign in (('10', 10, 0), ('s10', 10, 1), ('12', 12, 0),
+                        ('s12', 12, 1), ('14', 14, 0), ('s14', 14, 1)):
+    lo, hi = (-(1 << bits - 1), (1 << bits - 1) - 1) if sign else (0, (1 << bits) - 1)
+    vals = [lo + (i * 7919) % (hi - lo + 1) for i in range(203)]
+    vals[0:2] = [lo, hi]
+    f = datafile(len(vals) * 2)
+    m = smmap.mmap(f.fileno(), len(vals), fmt)
+    m.pack(array.array('h' if sign else 'H', vals))
+    raw = bitpack(vals, bits)
+    f.seek(0)
+    assert f.read(len(raw)) == raw
+    assert m[0:len(vals)] == tuple(vals)
+    for start in range(9):
+        out = array.array('h' if sign else 'H')
+        out.fromstring(str(m.unpack(start, len(vals) - start % 3)))
+        assert out.tolist() == vals[start:len(vals) - start % 3]
+    m.pack(array.array('h' if sign else 'H', vals[50:120]), 3)
+    assert m[3:73] == tuple(vals[50:120]) and m[0:3] == tuple(vals[0:3])
+    try:
+        m.pack(array.array('h' if sign else 'H', [hi, hi + 1 if hi < 32767 else lo - 1]))
+        assert False
+    except ValueError as e:
+        pass
+    try:
+        m.pack(bytearray('\x05\x00\x07'))
+        assert False
+    except ValueError as e:
+        pass
+print 'packed ok'
+
+# .npy files
+def npyfile(descr, shape, payload, fortran=False):
+    header = "{'descr': '%s', 'fortran_order': %s, 'shape': %r, }" % (
+        descr, fortran, shape)
+    header += ' ' * (63 - (len(header) + 10) % 64) + '\n'
+    f = tempfile.NamedTemporaryFile()
+    f.write('\x93NUMPY\x01\x00' + struct.pack('<H', len(header)) + header + payload)
+    f.flush()
+    return f
+
+f = npyfile('>i4', (2, 3), struct.pack('>6i', *range(6)))
+m = smmap.open_npy(f.name)
+assert m[0:len(m)] == tuple(range(6))
+f = npyfile('<f8', (4,), struct.pack('<4d', 1, 2, 3, 4), True)
+assert smmap.open_npy(f.name)[0:4] == (1.0, 2.0, 3.0, 4.0)
+for f in (npyfile('<i4', (100000,), struct.pack('<4i', 1, 2, 3, 4)),
+          npyfile('<i4', (2, 3), struct.pack('<6i', *range(6)), True)):
+    try:
+        smmap.open_npy(f.name)
+        assert False
+    except smmap.error as e:
+        print e
+
+samples = struct.pack('<8h', 1, -1, 2, -2, 3, -3, 4, -4)
+f = tempfile.NamedTemporaryFile()
+f.write('RIFF' + struct.pack('<I', 36 + len(samples)) + 'WAVE' +
+        'fmt ' + struct.pack('<IHHIIHH', 16, 1, 2, 8000, 32000, 4, 16) +
+        'data' + struct.pack('<I', len(samples)) + samples)
+f.flush()
+m, channels, rate = smmap.open_wav(f.name)
+assert (channels, rate) == (2, 8000)
+assert m.view(1, None, channels)[0:4] == (-1, -2, -3, -4)
+print 'npy ok'
+
+# sort and argsort
+for fmt in ('b', 'H', 'i', 'L', 'f', 'd'):
+    f = datafile(5000 * 8)
+    m = smmap.mmap(f.fileno(), 5000, fmt)
+    if fmt in 'fd':
+        vals = [((i * 7919) % 5000 - 2500) / 3.0 for i in range(5000)]
+    elif fmt == 'b':
+        vals = [(i * 7919) % 256 - 128 for i in range(5000)]
+    else:
+        vals = [(i * 7919) % 5000 for i in range(5000)]
+    m[0:5000] = vals
+    vals = list(m[0:5000])
+    for out_fmt in ('I', 'l'):
+        g = datafile(5000 * 8)
+        o = smmap.mmap(g.fileno(), 5000, out_fmt)
+        m.argsort(o, 10, 4990, threads=3, memory=0, tmpdir=tempfile.gettempdir())
+        assert list(o[0:4980]) == sorted(range(4980), key=lambda i: vals[10 + i])
+    m.sort(10, 4990, threads=4)
+    assert list(m[0:5000]) == vals[:10] + sorted(vals[10:4990]) + vals[4990:]
+try:
+    m.argsort(o, memory=-1)
+    assert False
+except ValueError as e:
+    pass
+# out must not overlap the elements it indexes
+f = datafile(400)
+m = smmap.mmap(f.fileno(), 100, 'I')
+m[0:100] = range(100, 0, -1)
+m.argsort(m.view(50, 100), 0, 50)
+assert m[50:100] == tuple(range(49, -1, -1))
+for out, start in ((m, 0), (m.view(40, 100), 0), (m.view(0, 50), 49)):
+    try:
+        m.argsort(out, start, start + 50)
+        assert False
+    except ValueError:
+        pass
+print 'sort ok'
+
+# windowed kernels
+vals = [(i * 7919) % 1000 - 500 for i in range(20000)]
+f = datafile(len(vals) * 2)
+m = smmap.mmap(f.fileno(), len(vals), '>h')
+m[0:len(vals)] = vals
+for w in (1, 5, 64):
+    for threads in (1, 3):
+        x = vals[100:9000]
+        n = len(x) - w + 1
+        assert list(m.rolling('min', w, 100, 9000, threads=threads)) == \
+            [min(x[k:k + w]) for k in range(n)]
+        assert list(m.rolling('max', w, 100, 9000, threads=threads)) == \
+            [max(x[k:k + w]) for k in range(n)]
+        assert list(m.rolling('sum', w, 100, 9000, threads=threads)) == \
+            [sum(x[k:k + w]) for k in range(n)]
+taps = [0.5, -1.0, 0.25]
+out = array.array('d', [0.0] * len(vals))
+assert m.fir(taps, out=out, threads=2) is out
+for k in range(len(vals) - 2):
+    assert out[k] == 0.25 * vals[k] - 1.0 * vals[k + 1] + 0.5 * vals[k + 2]
+# outputs must not overwrite elements other threads still read
+f = datafile(2000 * 8)
+m = smmap.mmap(f.fileno(), 2000, 'd')
+m[0:1000] = vals[0:1000]
+for out in (m, m.view(900, 2000)):
+    try:
+        m.rolling('mean', 8, 0, 1000, out=out, threads=4)
+        assert False
+    except ValueError:
+        pass
+m.rolling('sum', 8, 0, 1000, out=m.view(1000, 2000), threads=4)
+assert list(m[1000:1993]) == [sum(vals[k:k + 8]) for k in range(993)]
+print 'rolling ok'
+
+# transcode against item assignment
+def mapping(fmt, n):
+    f = datafile(n * 8)
+    return smmap.mmap(f.fileno(), n, fmt)
+
+limits = {'b': (-128, 127), 'H': (0, 65535), 'i': (-2 ** 31, 2 ** 31 - 1),
+          '12': (0, 4095), 's10': (-512, 511)}
+
+def saturated(v, fmt):
+    if fmt not in limits:
+        return v
+    if v != v:
+        return 0
+    return int(max(limits[fmt][0], min(limits[fmt][1], v)))
+
+warnings.simplefilter('ignore', DeprecationWarning)
+sources = (('h', [(i * 7919) % 65536 - 32768 for i in range(3000)]),
+           ('>I', [(i * 2654435761) % 2 ** 32 for i in range(3000)]),
+           ('d', [(i * 7919) % 5000 - 2500.75 for i in range(2999)] + [float('nan')]),
+           ('s14', [(i * 7919) % 16384 - 8192 for i in range(3000)]))
+for src_fmt, vals in sources:
+    n = len(vals)
+    src = mapping(src_fmt, n)
+    src[0:n] = vals
+    vals = list(src[0:n])
+    for dst_fmt in ('b', 'H', 'i', '<f', '>d', '12', 's10'):
+        for threads in (1, 4):
+            ref = mapping(dst_fmt, n)
+            dst = mapping(dst_fmt, n)
+            ref[0:n] = [saturated(v, dst_fmt) for v in vals]
+            smmap.transcode(src, dst, saturate=True, threads=threads)
+            assert repr(dst[0:n]) == repr(ref[0:n])
+            try:
+                for i in range(n):
+                    ref[i] = vals[i]
+                expected = None
+            except (ValueError, OverflowError) as e:
+                expected = (type(e), str(e))
+            try:
+                smmap.transcode(src, dst, threads=threads)
+                assert expected is None
+            except (ValueError, OverflowError) as e:
+                assert (type(e), str(e)) == expected
+            if expected is None:
+                assert repr(dst[0:n]) == repr(ref[0:n])
+            else:
+                assert dst[0:i] == ref[0:i]
+
+# interleaved to per channel
+f = datafile(3000 * 2)
+src = smmap.mmap(f.fileno(), 3000, '>h')
+src[0:3000] = range(-1500, 1500)
+dst = mapping('f', 1000)
+smmap.transcode(src.view(1, None, 3), dst)
+assert dst[0:1000] == tuple(float(v) for v in range(-1499, 1500, 3))
+print 'transcode ok'